@@ -7,7 +7,79 @@
  * Input:    Tab-delimited file(s) to analyze.
  * Output:   Summary information about the data.
  *
- * Compile:  run make
+ * Compile:  run make (make climate-release, climate-pgo or climate-asan for the
+ *           optimized, profile-guided or sanitizer-checked builds)
+ *
+ * Options:
+ *      -t, --threads N     worker threads (default: number of cores)
+ *      --states TN,WA      only use records of these states
+ *      --from TIME         only use records from TIME (UTC, YYYY-MM-DD or
+ *                          YYYY-MM-DDTHH:MM[:SS], or seconds since 1970) ...
+ *      --to TIME           ... up to but not including TIME
+ *      -g, --geohash N     also roll the records up per geohash prefix of N
+ *                          characters and list the hottest, coldest and
+ *                          stormiest cells after the report
+ *      --top K             length of those lists (default: 10)
+ *      --metrics LIST      also aggregate these derived metrics per state:
+ *                          pressure, dewpoint and heatindex, comma-separated,
+ *                          or all (see update_metrics)
+ *      --quantiles         also print the 50th, 95th and 99th percentile of
+ *                          temperature and humidity per state, from fixed-bin
+ *                          histograms (see print_quantiles)
+ *      --sample P          only read a random share P (e.g. 0.01) of each
+ *                          file's blocks; the report gives estimates of the
+ *                          counts with 95% confidence intervals, and the
+ *                          averages and extremes of the sample (see
+ *                          analyze_sampled)
+ *      --buckets UNIT      also keep per-state series of hour, day or month
+ *                          (UTC) buckets of the timestamps from 1970 up to
+ *                          2100; each state keeps the range it has seen
+ *      --series FILE       write the series to FILE instead of after the report
+ *      --series-format F   csv (default) or bin, see write_series
+ *      --format F          text (default) for the report, or json, csv or bin
+ *                          for the per-state aggregates with their raw sums
+ *                          and counts, so that results of several runs can
+ *                          be merged (see write_aggregates)
+ *      --emit-partial      the same as --format bin: write this run's partial
+ *                          aggregates to stdout for a later --merge
+ *      --merge             the files are partials (from --emit-partial or
+ *                          --format bin) to combine; the report is the one of
+ *                          a single run over their inputs in the given order
+ *      --max-line N        skip lines longer than N bytes (without the newline)
+ *                          as too long; by default lines may be of any length.
+ *                          A sidecar cache is then not used, and none can be
+ *                          built, nor an index or checkpoint
+ *      --columnar          aggregate in column batches with SIMD kernels
+ *      --prefetch N        read regular files ahead into N 8 MiB buffers
+ *                          (io_uring on Linux, else a reader thread) instead
+ *                          of mapping them, for storage where page faults stall
+ *      --build-cache       convert each file to a binary cache (file.tdvc) and
+ *                          exit; later runs on file read the cache instead
+ *                          while file's size and mtime are unchanged. Cache
+ *                          files can also be given directly.
+ *      --build-index       write a time-sorted index of each file's records
+ *                          per state (file.tdvi) and exit; later runs with
+ *                          --from, --to or --states on file only read the
+ *                          lines the index points them to (see analyze_indexed)
+ *      --bench             time the parse, lookup and aggregate stages and the
+ *                          whole pipeline per reader backend and thread count
+ *                          instead of printing the report (see make bench)
+ *      --stats             after the run, print bytes, lines, why lines were
+ *                          skipped and the time per stage to stderr
+ *      --stats-json        the same as one JSON object
+ *      --checkpoint FILE   keep each file's aggregates and consumed offset in
+ *                          FILE, so the next run only parses what was appended
+ *                          (a file rewritten at its start or end is parsed
+ *                          again); filtered runs leave it as it is
+ *      --report-every N    while reading a stream, print a rolling report
+ *                          after every N used records
+ *      --report-interval S while reading a stream, print a rolling report at
+ *                          most every S seconds (checked after each read)
+ *
+ * Files compressed with gzip or zstd are decompressed on the fly (by the gzip
+ * and zstd programs). zstd files of several frames, e.g. from zstd -B or
+ * concatenated .zst files, and BGZF files (bgzip) are decompressed in parallel.
+ * A file name of - reads standard input, e.g. zcat feed.tdv.gz | ./climate -
  *
  * Example Run:      ./climate data_tn.tdv data_wa.tdv
  *
@@ -63,198 +135,6860 @@
  *      surface temperature (Kelvin)
  */
 
+#define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+#define _DEFAULT_SOURCE  // syscall() for the io_uring reader
+#endif
+
+#include <errno.h>
 #include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define STATES_INITIAL 64          // First capacity of the per-state arrays
+#define PARSE_BUFFER 256          // Lines up to this long are re-parsed without malloc
+#define MAX_THREADS 256
+#define MIN_CHUNK_SIZE (1 << 20)  // Smallest byte range worth a task of its own
+#define CHUNKS_PER_WORKER 4       // Most chunk tasks per pool worker a large input is cut into
+#define BATCH_ROWS 4096           // Rows per batch in columnar mode
+#define STREAM_BUFFER (1 << 20)   // Read size for decompressed input
+#define PREFETCH_BUFFER (8 << 20) // Size of each read-ahead buffer (--prefetch)
+#define PREFETCH_MAX 64           // Most read-ahead buffers in flight
+#define PREFETCH_BENCH 4          // Buffers of the prefetch backend in --bench
+
+#define CACHE_MAGIC "TDVCACHE"
+#define CACHE_VERSION 2
+#define CACHE_BYTE_ORDER 0x01020304u
+#define CACHE_SUFFIX ".tdvc"
+#define CACHE_BLOCK_ROWS 65536
+#define CACHE_COLUMNS 8
+
+#define INDEX_MAGIC "TDVINDX1"
+#define INDEX_VERSION 1
+#define INDEX_SUFFIX ".tdvi"
+
+#define SAMPLE_BLOCK (64 << 10)     // Bytes per sampling block of a text file (--sample)
+#define SAMPLE_MIN_BLOCKS 8         // Inputs expected to yield fewer picked blocks are read in full
+#define SAMPLE_SEED 0x5DEECE66DULL  // Fixed, so an input gives the same sample on every run
+#define SAMPLE_Z 1.959963984540054  // Standard normal quantile of a 95% confidence interval
+
+#define CHECKPOINT_MAGIC "TDVCKPT1"
+#define CHECKPOINT_VERSION 5
+#define CHECKPOINT_FINGERPRINT 4096  // Bytes at the start and before the offset that must be unchanged
+
+
+#define ARENA_ALIGN 64            // Cache line: alignment and granularity of arena nodes
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+#define GEOHASH_MAX 12           // Characters in a geohash, and the finest -g precision
+#define KEY_INITIAL_SLOTS 64     // First size of a key_index hash
+#define TOP_CELLS 10             // Default length of the top cell lists (--top)
+
+#define SERIES_END 4102444800ULL  // 2100-01-01 UTC: later timestamps are not bucketed
+#define SERIES_MAGIC "TDVSERS1"
+#define SERIES_VERSION 1
+
+#define AGGREGATE_MAGIC "TDVAGGR1"
+#define AGGREGATE_VERSION 3
+
+#define OUT_INITIAL 4096     // First capacity of an output buffer
+#define TIME_CACHE_SIZE 1024 // Converted times kept per formatting task
+#define FIXED_FAST_MAX 1e9L  // Larger magnitudes are left to snprintf
+#define SHARD_ROWS 4096      // Report lines worth a formatting task of their own
+
+#define TEMP_BIN_MIN 173.0   // Kelvin at the centre of the first bin (about -148F)
+#define TEMP_BIN_MAX 353.0   // ... and of the last (about 176F)
+#define TEMP_BINS 1801       // 0.1 K wide
+#define HUMIDITY_BINS 1001   // 0.1 % wide, 0 to 100
 
-#define NUM_STATES 50
-#define LINE_BUFFER 100
+enum { SIMD_NONE, SIMD_AVX2, SIMD_NEON };
+enum { SAMPLE_RECORDS, SAMPLE_LIGHTNING, SAMPLE_SNOW, NUM_SAMPLE_COUNTS };
+enum { STATS_TEXT = 1, STATS_JSON };
+enum { CELL_HOTTEST, CELL_COLDEST, CELL_STORMIEST };
+enum { BUCKET_HOUR = 1, BUCKET_DAY, BUCKET_MONTH };
+enum { SERIES_CSV, SERIES_BIN };
+enum { FORMAT_TEXT, FORMAT_JSON, FORMAT_CSV, FORMAT_BIN };
+enum { COMPRESSION_NONE, COMPRESSION_GZIP, COMPRESSION_ZSTD };
+enum { METRIC_PRESSURE = 1, METRIC_DEW_POINT = 2, METRIC_HEAT_INDEX = 4, METRICS_ALL = 7 };
 
+// Why a line was not used (see struct scan_stats)
+enum { SKIP_TOO_LONG, SKIP_MALFORMED, SKIP_OUT_OF_RANGE, SKIP_FILTERED, NUM_SKIPS };
+
+// Timed stages of a scan; read covers getting (and splitting) lines in
+enum { STAGE_READ, STAGE_PARSE, STAGE_VALIDATE, STAGE_LOOKUP, STAGE_AGGREGATE, NUM_STAGES };
+
+/*
+ * Aggregates of one state (or geohash cell). The fields up to
+ * cloudcover_error are the ones every record updates. Those up to
+ * snow_records take 64 bytes, so in a node from the (cache-line aligned)
+ * arena they share a single line; the two compensation terms of humidity
+ * and cloud cover start the next one. The fields after them are only
+ * written on a new extreme, or when a 32-bit flag counter carries (see
+ * add_count and lightning_count).
+ *
+ * The sums are doubles, and temperature, humidity and cloud cover are
+ * compensated (Neumaier): with u = 2^-53 the error of such a sum S is at
+ * most 2u|S| + O(n u^2) sum|x| (Higham, Accuracy and Stability of Numerical
+ * Algorithms, 4.3). Averages thus come out the same for any split of the
+ * records into chunks and threads, also where an exact average sits on a
+ * one-decimal rounding boundary.
+ *
+ * The --metrics sums sit in the cold part, and stay 0 unless selected.
+ */
 struct climate_info {
+    unsigned long num_records;
+    double sum_temperature;         // Neumaier sum: sum_temperature + temperature_error
+    double temperature_error;
+    double sum_humidity;            // Neumaier sum: sum_humidity + humidity_error
+    double sum_cloudcover;          // Neumaier sum: sum_cloudcover + cloudcover_error
+    double max_temp;
+    double min_temp;
+    uint32_t lightning_strikes;     // Low 32 bits; the carries go to lightning_high
+    uint32_t snow_records;          // Low 32 bits; the carries go to snow_high
+    double humidity_error;
+    double cloudcover_error;
     char code[3];
+    uint32_t lightning_high;
+    uint32_t snow_high;
+    time_t max_temp_time;
+    time_t min_temp_time;
+    double sum_pressure;            // Pa
+    double sum_dew_point;           // Kelvin, over the dew_point_records
+    double sum_heat_index;          // Kelvin
+    unsigned long dew_point_records;  // Records with humidity above 0, which have a dew point
+};
+
+/*
+ * What a scan went through. Each thread counts into its private table, and
+ * the counts are added up when the tables are merged. Stage ticks are only
+ * taken with --stats (see stage_clock).
+ */
+struct scan_stats {
+    uint64_t bytes;
+    uint64_t lines;
+    uint64_t used;
+    uint64_t skipped[NUM_SKIPS];
+    uint64_t ticks[NUM_STAGES];
+};
+
+// Memory the aggregate nodes of a table are carved from (see arena_alloc)
+struct arena_block {
+    struct arena_block *next;
+};
+
+struct arena {
+    struct arena_block *blocks;  // Newest first
+    char *next;                  // Free space left in the newest block
+    size_t left;
+};
+
+/*
+ * Index of nonzero 64-bit keys (state codes, geohash cells, cache codes).
+ * keys[] holds them in first-seen order, so a key's position is also its
+ * slot in whatever its owner keeps per key; slots[] is an open-addressing
+ * hash over them with linear probing, doubled at 70% load (see key_insert).
+ * Each hash slot repeats its key, so a hit costs one load. All zero while
+ * empty.
+ */
+struct key_slot {
+    uint64_t key;              // 0 = empty
+    uint32_t position;         // In keys[]
+};
+
+struct key_index {
+    uint64_t *keys;            // By position, first seen first
+    struct key_slot *slots;
+    size_t capacity;           // Hash slots, a power of two
+    size_t count;              // Keys
+    size_t reserved;           // Room in keys[]
+};
+
+// Geohash cells of -g mode (see find_cell); all zero while there are none
+struct geo_table {
+    struct key_index index;
+    struct climate_info **cells;  // By position in index, allocated in the table's arena
+    size_t reserved;           // Room in cells[]
+};
+
+// One (state, time bucket) aggregate of --buckets mode
+struct time_bucket {
     unsigned long num_records;
-    long double sum_temperature;
-    long double sum_humidity;
-    long double sum_cloudcover;
+    double sum_temperature;
+    double sum_humidity;
+    double sum_cloudcover;
     unsigned long lightning_strikes;
     unsigned long snow_records;
-    time_t max_temp_time;
-    time_t min_temp_time;
-    long double max_temp;
-    long double min_temp;
 };
 
-int analyze_file(FILE *file, struct climate_info **states, int num_states);
+// The buckets of one state (see reserve_series); all zero while there are none
+struct time_row {
+    int64_t first;             // Bucket number of buckets[0]
+    size_t span;               // Buckets in the row
+    struct time_bucket *buckets;
+};
+
+// Per-state rows of buckets; all zero while there are none
+struct series {
+    struct time_row *rows;     // By state slot, span 0 until the state has one
+    size_t num_rows;           // Slots rows[] has room for
+};
+
+// Binary series file header (see write_series)
+struct series_header {
+    char magic[8];             // SERIES_MAGIC
+    uint32_t version;          // SERIES_VERSION
+    uint32_t unit;             // BUCKET_HOUR, BUCKET_DAY or BUCKET_MONTH
+    uint32_t num_states;
+    uint32_t reserved;
+    int64_t first_start;       // Start of the first bucket, seconds since 1970 UTC
+    int64_t first;             // Its bucket number (hours, days or months since 1970)
+    uint64_t span;             // Buckets per state
+};
+
+// One bucket in a binary series file
+struct series_point {
+    double temperature;        // Averages: Fahrenheit, percent, percent
+    double humidity;
+    double cloudcover;
+    uint64_t num_records;
+    uint64_t lightning_strikes;
+    uint64_t snow_records;
+};
+
+// Histograms of one state (see quantile_of)
+struct sketch {
+    uint64_t temperature[TEMP_BINS];
+    uint64_t humidity[HUMIDITY_BINS];
+};
+
+/*
+ * One state's records, lightning strikes and snow records in the blocks a
+ * --sample run left out (see analyze_sampled): the estimates and their
+ * variances, and while a file is scanned the sums they are derived from.
+ */
+struct sample_counts {
+    double unread[NUM_SAMPLE_COUNTS];    // Estimated count in the blocks not read
+    double variance[NUM_SAMPLE_COUNTS];  // Variance of that estimate
+    uint64_t counts[NUM_SAMPLE_COUNTS];  // Sum over the picked blocks of a block's count y,
+    uint64_t squares[NUM_SAMPLE_COUNTS]; // ... of y * y
+    uint64_t cross[NUM_SAMPLE_COUNTS];   // ... and of y times the block's bytes
+    uint64_t marks[NUM_SAMPLE_COUNTS];   // The state's counts when the last block was folded
+};
+
+/*
+ * The states seen so far. states[] keeps them in first-seen order for the
+ * report, and a state's slot is its position there and in index (keyed by
+ * code_key), which grows with the number of codes. All zero while empty.
+ */
+struct state_table {
+    struct climate_info **states;
+    int num_states;            // The same as index.count
+    int max_states;            // Room in states[], sketches[] and samples[]
+    struct key_index index;
+    struct scan_stats stats;
+    struct geo_table geo;
+    struct series series;
+    struct sketch **sketches;  // --quantiles: by state slot, in the arena
+    struct sample_counts **samples;  // --sample: by state slot, in the arena
+    struct arena arena;        // Owns the states' and cells' nodes, the sketches and samples
+    struct climate_info discard;  // Takes the out-of-range rows (see process_line), never reported
+};
+
+// One parsed TDV line, in the same types the sscanf conversion produced
+struct tdv_record {
+    char state_code[3];
+    unsigned long long timestamp;
+    char geohash[13];
+    double humidity, snow, cloudcover, lightning, pressure, temperature;
+};
+
+// Accepted rows of one columnar batch, one contiguous array per field
+struct column_batch {
+    size_t count;
+    int slot[BATCH_ROWS];  // Position of the row's state in the state table
+    uint64_t timestamp[BATCH_ROWS];
+    double temperature[BATCH_ROWS];
+    double humidity[BATCH_ROWS];
+    double cloudcover[BATCH_ROWS];
+    double pressure[BATCH_ROWS];
+    unsigned char snow[BATCH_ROWS];       // 1 if the record had snow > 0
+    unsigned char lightning[BATCH_ROWS];  // 1 if the record had lightning > 0
+};
+
+// Read-only column arrays of consecutive rows, in a batch or a mapped cache block
+struct column_view {
+    const uint64_t *timestamp;
+    const double *temperature;
+    const double *humidity;
+    const double *cloudcover;
+    const double *pressure;
+    const unsigned char *snow;
+    const unsigned char *lightning;
+};
+
+// The batch being filled, plus room to regroup it by state when it mixes states
+struct columnar_buffer {
+    struct column_batch rows;
+    struct column_batch grouped;
+    size_t *start;             // flush_columns: first grouped row per state slot, and the next
+    size_t reserved;           // Room in start[]
+};
+
+// On-disk header of a binary cache file (see build_cache)
+struct cache_header {
+    char magic[8];             // CACHE_MAGIC
+    uint32_t version;          // CACHE_VERSION
+    uint32_t byte_order;       // CACHE_BYTE_ORDER as stored by the writer
+    uint64_t source_size;      // Size and mtime of the .tdv the cache was built from
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint64_t num_rows;
+    uint32_t num_codes;        // Entries in the state dictionary
+    uint32_t num_blocks;
+    uint64_t dict_offset;      // File offset of the state dictionary
+};
+
+// Header in front of every block of rows; the zone map lets filters skip it
+struct cache_block {
+    uint32_t num_rows;
+    uint32_t reserved;
+    uint64_t size;             // Bytes from this header to the next block
+    uint64_t min_timestamp;    // Range of the rows' timestamps
+    uint64_t max_timestamp;
+    uint64_t states;           // Bit (code % 64) set for every dictionary code in the block
+    uint64_t padding[3];       // Keeps the columns cache-line aligned
+};
+
+// On-disk header of an index sidecar (see build_index)
+struct index_header {
+    char magic[8];             // INDEX_MAGIC
+    uint32_t version;          // INDEX_VERSION
+    uint32_t byte_order;       // CACHE_BYTE_ORDER as stored by the writer
+    uint64_t source_size;      // Size and mtime of the .tdv the index was built from
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint64_t num_entries;
+    uint32_t num_codes;
+    uint32_t reserved;
+};
+
+// The run of index entries of one state code
+struct index_code {
+    char code[4];
+    uint32_t reserved;
+    uint64_t first;            // Position of the first entry
+    uint64_t count;
+};
+
+// One accepted line of the source: where it starts, and its timestamp
+struct index_entry {
+    uint64_t timestamp;
+    uint64_t offset;
+};
+
+// An index file mapped for reading
+struct index_map {
+    const char *data;
+    size_t size;
+    const struct index_header *header;
+    const struct index_code *codes;
+    const struct index_entry *entries;
+};
+
+// A cache file mapped for reading
+struct cache_map {
+    const char *data;
+    size_t size;
+    const struct cache_header *header;
+    const char (*codes)[4];    // State dictionary
+    size_t *blocks;            // Offset of every block, plus the end of the last
+};
+
+// On-disk form of one climate_info, as stored in checkpoints
+struct state_record {
+    char code[4];
+    uint32_t reserved;
+    uint64_t num_records;
+    uint64_t lightning_strikes;
+    uint64_t snow_records;
+    int64_t max_temp_time;
+    int64_t min_temp_time;
+    double sum_temperature;
+    double temperature_error;
+    double sum_humidity;
+    double sum_cloudcover;
+    double max_temp;
+    double min_temp;
+    uint64_t dew_point_records;
+    double humidity_error;
+    double cloudcover_error;
+    double sum_pressure;
+    double sum_dew_point;
+    double sum_heat_index;
+};
+
+// Start of a checkpoint file (see save_checkpoint)
+struct checkpoint_header {
+    char magic[8];             // CHECKPOINT_MAGIC
+    uint32_t version;          // CHECKPOINT_VERSION
+    uint32_t byte_order;       // CACHE_BYTE_ORDER as stored by the writer
+    uint32_t record_size;      // sizeof(struct state_record)
+    uint32_t num_files;
+    uint32_t metrics;          // METRIC_* sums the records were kept with
+};
+
+// Start of a --format bin file, followed by num_states state_records (see write_aggregates)
+struct aggregate_header {
+    char magic[8];             // AGGREGATE_MAGIC
+    uint32_t version;          // AGGREGATE_VERSION
+    uint32_t byte_order;       // CACHE_BYTE_ORDER as stored by the writer
+    uint32_t record_size;      // sizeof(struct state_record)
+    uint32_t num_states;
+    uint32_t metrics;          // METRIC_* sums the records were kept with
+};
+
+// Per-file part of a checkpoint, followed by the path and the state records
+struct checkpoint_entry {
+    uint32_t path_len;
+    uint32_t num_states;
+    uint64_t device;           // Identity of the file the offset refers to
+    uint64_t inode;
+    uint64_t offset;           // Bytes consumed, always right after a newline
+    uint64_t fingerprint;      // checkpoint_fingerprint() at offset
+};
+
+// A file's checkpoint in memory
+struct file_checkpoint {
+    char *path;
+    struct checkpoint_entry entry;
+    struct state_table table;  // Aggregates of the first entry.offset bytes
+};
+
+struct checkpoint {
+    struct file_checkpoint *files;
+    uint32_t num_files;
+};
+
+// Command line settings shared by the analysis routines
+struct options {
+    int num_threads;    // Worker threads in total, defaults to the number of cores
+    int columnar;       // Aggregate in column batches with the SIMD kernels
+    int simd;           // SIMD_* kernels the CPU supports
+    int build_cache;    // Convert the files to .tdvc caches instead of analyzing them
+    int build_index;    // Write .tdvi index sidecars for the files instead of analyzing them
+    const char *checkpoint;  // Checkpoint file for incremental runs, or NULL
+    int bench;          // Time the reader backends and stages instead of reporting
+    int stats;          // 0 = off, else STATS_TEXT or STATS_JSON on stderr after the run
+    int geohash;        // Geohash cell precision in characters (0 = no cells)
+    int top_cells;      // Length of the top cell lists
+    int buckets;        // BUCKET_* unit of the time series, 0 = no series
+    const char *series_path;  // Where the series go, NULL = stdout after the report
+    int series_format;  // SERIES_CSV or SERIES_BIN
+    int format;         // FORMAT_TEXT for the report, else the aggregates in that format
+    int merge;          // The files are partial aggregates to combine (--merge)
+    unsigned long report_every;  // Streams: rolling report every N records (0 = off)
+    double report_interval;      // Streams: rolling report every S seconds (0 = off)
+    int prefetch;       // Read-ahead buffers in flight for regular files, 0 = map them
+    size_t max_line;    // Longest usable line in bytes without the newline, 0 = no limit
+    int quantiles;      // Keep per-state sketches and print p50/p95/p99 after the report
+    unsigned metrics;   // METRIC_* derived metrics to aggregate (--metrics), 0 = none
+    double sample;      // Share of the blocks to read (--sample), 0 = all of them
+    int filter_states;  // Only use the codes in wanted_states (--states)
+    uint64_t wanted_states[1024];  // Bit per two-character code, see state_key
+    int filter_time;    // Only use timestamps in [from_ms, to_ms) (--from, --to)
+    unsigned long long from_ms;
+    unsigned long long to_ms;
+};
+
+// Rolling reports for streamed input, printed by their own thread from snapshots
+struct reporter {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int pending;                 // A snapshot is waiting to be printed
+    int done;                    // The stream has ended
+    unsigned long records;       // Records used when the snapshot was taken
+    int num_states;
+    int max_states;              // Room in states[]
+    struct climate_info *states;
+};
+
+static struct options options;
+
+int parse_options(int argc, char *argv[], char *files[]);
+static int start_pool(int num_workers);
+static void stop_pool(void);
+int analyze_files(char *files[], int num_files, struct state_table *table);
+int analyze_path(const char *path, struct state_table *table);
+int analyze_file(FILE *file, struct state_table *table);
+int analyze_buffer(const char *data, size_t size, struct state_table *table);
+static long analyze_range(const char *data, size_t size, struct state_table *table);
+static long analyze_sampled(const char *data, size_t size, struct state_table *table);
+static void *map_file(FILE *file, size_t *size);
+static int compression_of(const char *data, size_t size);
+static long analyze_compressed(const char *data, size_t size, int kind, struct state_table *table);
+static long analyze_prefetched(FILE *file, struct state_table *table);
+static int start_reporter(struct reporter *reporter);
+static void publish_report(struct reporter *reporter, const struct state_table *table,
+                           unsigned long records);
+static int report_now(struct reporter *reporter, struct state_table *table, struct columnar_buffer *columns,
+                      unsigned long records, unsigned long *next_report, struct timespec *last_report);
+static void stop_reporter(struct reporter *reporter);
+static long scan_buffer(const char *data, size_t size, struct state_table *table);
+static long scan_lines(const char *data, size_t size, const uint64_t *offsets, size_t n,
+                       struct state_table *table);
+static int next_line(const char **p, const char *end, const char **line, size_t *len);
+static int read_record(const char *line, size_t len, struct tdv_record *rec);
+static int validate_record(const struct tdv_record *rec);
+static int filter_fields(const char *line, size_t len);
+static int code_wanted(const char *code);
+static int filter_record(const struct tdv_record *rec);
+static unsigned state_key(char a, char b);
+static int parse_time(const char *text, unsigned long long *ms);
+static int64_t days_from_civil(int64_t year, int month, int day);
+static int is_field_end(char c);
+static int is_digit(char c);
+static uint64_t stage_clock(void);
+static void calibrate_ticks(uint64_t start, uint64_t end, double seconds);
+static uint64_t staged_ticks(const struct scan_stats *stats);
+static void charge_read(struct scan_stats *stats, uint64_t start, uint64_t staged);
+void add_stats(struct scan_stats *dst, const struct scan_stats *src);
+void print_stats(const struct scan_stats *stats, double seconds);
+static int process_line(const char *line, size_t len, struct state_table *table,
+                        struct columnar_buffer *columns);
+static int detect_simd(void);
+static struct columnar_buffer *new_columns(void);
+static void free_columns(struct columnar_buffer *columns);
+static int append_columns(struct state_table *table, struct columnar_buffer *columns,
+                           int slot, const struct tdv_record *rec);
+static int flush_columns(struct state_table *table, struct columnar_buffer *columns);
+static void reduce_columns(struct climate_info *info, const struct column_view *rows, size_t n);
+static void update_state(struct climate_info *info, double temperature, double humidity,
+                         double cloudcover, int lightning, int snow,
+                         unsigned long long timestamp);
+static void add_count(uint32_t *low, uint32_t *high, uint64_t n);
+unsigned long lightning_count(const struct climate_info *info);
+unsigned long snow_count(const struct climate_info *info);
+long double temperature_total(const struct climate_info *info);
+long double humidity_total(const struct climate_info *info);
+long double cloudcover_total(const struct climate_info *info);
+static void neumaier_add(double *sum, double *comp, double x);
+static void update_metrics(struct climate_info *info, double temperature, double humidity,
+                           double pressure);
+static void reduce_metrics(struct climate_info *info, const struct column_view *rows, size_t n);
+int build_cache(const char *path);
+int build_index(const char *path);
+int open_index(const char *path, int fd, struct index_map *index);
+void close_index(struct index_map *index);
+int analyze_indexed(FILE *file, const struct index_map *index, struct state_table *table);
+int open_cache(const char *path, int fd, struct cache_map *cache);
+static int map_cache(int fd, struct cache_map *cache);
+void close_cache(struct cache_map *cache);
+int analyze_cache(const struct cache_map *cache, struct state_table *table);
+int bench_path(const char *path);
+static long scan_cache(const struct cache_map *cache, size_t first, size_t count,
+                       struct state_table *table);
+int find_state(struct state_table *table, const char *code);
+static int seen_state(const struct state_table *table, const char *code);
+static long key_find(const struct key_index *index, uint64_t key);
+static long key_insert(struct key_index *index, uint64_t key);
+static void free_keys(struct key_index *index);
+static void *reserve_array(void *array, size_t *reserved, size_t needed, size_t size);
+static uint64_t code_key(const char *code);
+struct climate_info *find_cell(struct geo_table *geo, struct arena *arena, uint64_t key);
+static void init_geohash(void);
+static uint64_t geo_key(const char *geohash);
+static void merge_info(struct climate_info *info, const struct climate_info *from);
+static int merge_cells(struct geo_table *dst, struct arena *arena, const struct geo_table *src);
+static int copy_cells(struct geo_table *dst, struct arena *arena, const struct geo_table *src);
+static void free_cells(struct geo_table *geo);
+void print_cells(const struct geo_table *geo);
+static int add_to_sketch(struct state_table *table, int slot, double temperature, double humidity);
+static int merge_sketch(struct state_table *dst, int dst_slot, const struct state_table *src,
+                        int src_slot);
+void print_quantiles(const struct state_table *table);
+static int merge_sample(struct state_table *dst, int dst_slot, const struct state_table *src,
+                        int src_slot);
+static int add_to_series(struct series *series, int slot, double temperature, double humidity,
+                         double cloudcover, int lightning, int snow,
+                         unsigned long long timestamp);
+static int merge_series(struct series *dst, int dst_slot, const struct series *src, int src_slot);
+static int copy_series(struct series *dst, const struct series *src);
+static void free_series(struct series *series);
+int write_series(const struct state_table *table, FILE *out);
+struct out_buffer;
+// Formats shard i of a report into out (see write_shards)
+typedef void (*format_shard)(const void *ctx, size_t shard, struct out_buffer *out);
+static int write_shards(FILE *file, size_t num_shards, size_t rows, format_shard format,
+                        const void *ctx);
+static void format_series_rows(const void *ctx, size_t shard, struct out_buffer *out);
+static void format_state(const void *ctx, size_t shard, struct out_buffer *out);
+long merge_states(struct state_table *dst, struct state_table *src);
+int copy_states(struct state_table *dst, const struct state_table *src);
+void free_states(struct state_table *table);
+static void *arena_alloc(struct arena *arena, size_t size);
+static void release_arena(struct arena *arena);
+int load_checkpoint(const char *path, struct checkpoint *ckpt);
+int save_checkpoint(const char *path, const struct checkpoint *ckpt);
 void print_report(struct climate_info *states[], int num_states);
+static void report_states(struct climate_info *states[], struct sample_counts *samples[],
+                          int num_states);
+int write_aggregates(const struct state_table *table, FILE *out);
+int merge_partials(char *files[], int num_files, struct state_table *table);
+int parse_record(const char *line, size_t len, struct tdv_record *rec);
 
 int main(int argc, char *argv[]) {
+    char **files = malloc(sizeof(char *) * (size_t)argc);
+    if (files == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return EXIT_FAILURE;
+    }
+    int num_files = parse_options(argc, argv, files);
+    if (num_files < 0) {
+        free(files);
+        return EXIT_FAILURE;
+    }
+
     // Check if any files were provided
-    if (argc < 2) { //checks if there are enough arguments
+    if (num_files < 1) { //checks if there are enough arguments
         fprintf(stderr, "Not enough arguments provided. No file provided to analyze.\n");
+        free(files);
         return EXIT_FAILURE;
     }
-
-    // Print all filenames first
-    int i;
-    for (i = 1; i < argc; ++i) {
-        printf("Opening file: %s\n", argv[i]);
+    if (start_pool(options.num_threads) != 0) {
+        fprintf(stderr, "Error: Unable to start the worker threads\n");
+        free(files);
+        return EXIT_FAILURE;
     }
 
-    struct climate_info *states[NUM_STATES] = { NULL };
-    int files_processed = 0;  // Track if any files were successfully processed
-
-    // Process the files
-    for (i = 1; i < argc; ++i) {
-        FILE *file = fopen(argv[i], "r");
-        if (file == NULL) {
-            fprintf(stderr, "Unable to open file: %s\n", argv[i]);
-            continue;
+    if (options.build_cache || options.build_index) {
+        int failed = 0;
+        for (int i = 0; i < num_files; ++i) {
+            if (options.build_cache) {
+                printf("Building cache: %s%s\n", files[i], CACHE_SUFFIX);
+                failed |= build_cache(files[i]) != 0;
+            }
+            if (options.build_index) {
+                printf("Building index: %s%s\n", files[i], INDEX_SUFFIX);
+                failed |= build_index(files[i]) != 0;
+            }
         }
+        free(files);
+        stop_pool();
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
 
-        if (analyze_file(file, states, NUM_STATES) == 0) {
-            files_processed++;
-        } else {
-            fprintf(stderr, "Error processing file: %s\n", argv[i]);
+    if (options.bench) {
+        int failed = 0;
+        for (int i = 0; i < num_files; ++i) {
+            failed |= bench_path(files[i]) != 0;
         }
-        fclose(file);
+        free(files);
+        stop_pool();
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    // Print all filenames first
+    int i;
+    for (i = 0; i < num_files && options.format == FORMAT_TEXT; ++i) {
+        printf("Opening file: %s\n", files[i]);
+    }
+
+    static struct state_table table;  // Zero-initialized: no states yet
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t start_ticks = stage_clock();
+    int files_processed = options.merge ? merge_partials(files, num_files, &table)
+                                        : analyze_files(files, num_files, &table);
+    if (options.stats) {
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        double seconds = (double)(stop.tv_sec - start.tv_sec) +
+                         (double)(stop.tv_nsec - start.tv_nsec) / 1e9;
+        calibrate_ticks(start_ticks, stage_clock(), seconds);
+        print_stats(&table.stats, seconds);
     }
 
     // Check if any files were successfully processed
+    free(files);
     if (files_processed == 0) {
         fprintf(stderr, "No valid files were processed.\n");
+        stop_pool();
         return EXIT_FAILURE;
     }
 
-    print_report(states, NUM_STATES);
+    int failed = 0;
+    if (options.format != FORMAT_TEXT) {
+        failed = write_aggregates(&table, stdout) != 0 || fflush(stdout) != 0;
+        if (failed) {
+            fprintf(stderr, "Unable to write aggregates: stdout\n");
+        }
+    } else {
+        report_states(table.states, table.samples, table.num_states);
+    }
+    if (options.quantiles) {
+        print_quantiles(&table);
+    }
+    if (options.geohash) {
+        print_cells(&table.geo);
+    }
+    if (options.buckets) {
+        FILE *out = options.series_path != NULL ? fopen(options.series_path, "wb") : stdout;
+        failed = out == NULL || write_series(&table, out) != 0;
+        if (out != NULL && out != stdout && fclose(out) != 0) {
+            failed = 1;
+        }
+        if (failed) {
+            fprintf(stderr, "Unable to write series: %s\n",
+                    options.series_path != NULL ? options.series_path : "stdout");
+        }
+    }
 
     // Free allocated memory
-    for (i = 0; i < NUM_STATES; i++) {
-        if (states[i] != NULL) {
-            free(states[i]);
+    free_states(&table);
+    stop_pool();
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Reads the options out of argv and collects the remaining file names; returns the file count
+int parse_options(int argc, char *argv[], char *files[]) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    options.num_threads = cores > 0 ? (int)(cores < MAX_THREADS ? cores : MAX_THREADS) : 1;
+    options.columnar = 0;
+    options.build_cache = 0;
+    options.build_index = 0;
+    options.checkpoint = NULL;
+    options.bench = 0;
+    options.stats = 0;
+    options.geohash = 0;
+    options.top_cells = TOP_CELLS;
+    options.buckets = 0;
+    options.series_path = NULL;
+    options.series_format = SERIES_CSV;
+    options.format = FORMAT_TEXT;
+    options.merge = 0;
+    options.report_every = 0;
+    options.report_interval = 0;
+    options.prefetch = 0;
+    options.max_line = 0;
+    options.quantiles = 0;
+    options.metrics = 0;
+    options.sample = 0;
+    options.filter_states = 0;
+    memset(options.wanted_states, 0, sizeof(options.wanted_states));
+    options.filter_time = 0;
+    options.from_ms = 0;
+    options.to_ms = ULLONG_MAX;
+    options.simd = detect_simd();
+
+    int num_files = 0;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "-t") == 0 || strcmp(arg, "--threads") == 0) {
+            char *end;
+            long n = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+            if (n < 1 || n > MAX_THREADS || *end != '\0') {
+                fprintf(stderr, "Invalid thread count for %s (expected 1-%d)\n", arg, MAX_THREADS);
+                return -1;
+            }
+            options.num_threads = (int)n;
+            i++;
+        } else if (strcmp(arg, "--columnar") == 0) {
+            options.columnar = 1;
+        } else if (strcmp(arg, "--build-cache") == 0) {
+            options.build_cache = 1;
+        } else if (strcmp(arg, "--build-index") == 0) {
+            options.build_index = 1;
+        } else if (strcmp(arg, "-g") == 0 || strcmp(arg, "--geohash") == 0) {
+            char *end;
+            long n = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+            if (n < 1 || n > GEOHASH_MAX || *end != '\0') {
+                fprintf(stderr, "Invalid geohash precision for %s (expected 1-%d)\n", arg, GEOHASH_MAX);
+                return -1;
+            }
+            options.geohash = (int)n;
+            init_geohash();
+            i++;
+        } else if (strcmp(arg, "--top") == 0) {
+            char *end;
+            long n = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+            if (n < 1 || n > 100000 || *end != '\0') {
+                fprintf(stderr, "Invalid cell count for %s\n", arg);
+                return -1;
+            }
+            options.top_cells = (int)n;
+            i++;
+        } else if (strcmp(arg, "--buckets") == 0) {
+            const char *unit = i + 1 < argc ? argv[++i] : "";
+            options.buckets = strcmp(unit, "hour") == 0    ? BUCKET_HOUR
+                              : strcmp(unit, "day") == 0   ? BUCKET_DAY
+                              : strcmp(unit, "month") == 0 ? BUCKET_MONTH
+                                                           : 0;
+            if (options.buckets == 0) {
+                fprintf(stderr, "Invalid bucket size for %s (expected hour, day or month)\n", arg);
+                return -1;
+            }
+        } else if (strcmp(arg, "--states") == 0) {
+            const char *list = i + 1 < argc ? argv[++i] : "";
+            for (const char *p = list; ; p += 3) {
+                if (is_field_end(p[0]) || is_field_end(p[1]) || p[0] == ',' || p[1] == ',' ||
+                    (p[2] != ',' && p[2] != '\0')) {
+                    fprintf(stderr, "Invalid state list for %s (expected codes like TN,WA)\n", arg);
+                    return -1;
+                }
+                unsigned key = state_key(p[0], p[1]);
+                options.wanted_states[key / 64] |= 1ULL << (key % 64);
+                if (p[2] == '\0') break;
+            }
+            options.filter_states = 1;
+        } else if (strcmp(arg, "--from") == 0 || strcmp(arg, "--to") == 0) {
+            unsigned long long ms;
+            if (i + 1 >= argc || parse_time(argv[i + 1], &ms) != 0) {
+                fprintf(stderr, "Invalid time for %s (expected YYYY-MM-DD[THH:MM[:SS]] UTC or seconds)\n", arg);
+                return -1;
+            }
+            *(arg[2] == 'f' ? &options.from_ms : &options.to_ms) = ms;
+            options.filter_time = 1;
+            i++;
+        } else if (strcmp(arg, "--quantiles") == 0) {
+            options.quantiles = 1;
+        } else if (strcmp(arg, "--metrics") == 0) {
+            static const char *const names[] = { "pressure", "dewpoint", "heatindex", "all" };
+            static const unsigned bits[] = { METRIC_PRESSURE, METRIC_DEW_POINT, METRIC_HEAT_INDEX,
+                                             METRICS_ALL };
+            const char *list = i + 1 < argc ? argv[++i] : "";
+            for (const char *p = list; ; p++) {
+                size_t len = strcspn(p, ",");
+                unsigned metric = 0;
+                for (int m = 0; m < 4; m++) {
+                    if (strlen(names[m]) == len && strncmp(p, names[m], len) == 0) {
+                        metric = bits[m];
+                    }
+                }
+                if (metric == 0) {
+                    fprintf(stderr, "Invalid metric list for %s (expected pressure, dewpoint, "
+                                    "heatindex or all, comma-separated)\n", arg);
+                    return -1;
+                }
+                options.metrics |= metric;
+                p += len;
+                if (*p == '\0') break;
+            }
+        } else if (strcmp(arg, "--series") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing file name for %s\n", arg);
+                return -1;
+            }
+            options.series_path = argv[++i];
+        } else if (strcmp(arg, "--series-format") == 0) {
+            const char *format = i + 1 < argc ? argv[++i] : "";
+            if (strcmp(format, "csv") == 0) {
+                options.series_format = SERIES_CSV;
+            } else if (strcmp(format, "bin") == 0) {
+                options.series_format = SERIES_BIN;
+            } else {
+                fprintf(stderr, "Invalid series format for %s (expected csv or bin)\n", arg);
+                return -1;
+            }
+        } else if (strcmp(arg, "--format") == 0) {
+            static const char *const formats[] = { "text", "json", "csv", "bin" };
+            const char *format = i + 1 < argc ? argv[++i] : "";
+            options.format = -1;
+            for (int f = FORMAT_TEXT; f <= FORMAT_BIN; f++) {
+                if (strcmp(format, formats[f]) == 0) {
+                    options.format = f;
+                }
+            }
+            if (options.format < 0) {
+                fprintf(stderr, "Invalid format for %s (expected text, json, csv or bin)\n", arg);
+                return -1;
+            }
+        } else if (strcmp(arg, "--emit-partial") == 0) {
+            options.format = FORMAT_BIN;
+        } else if (strcmp(arg, "--merge") == 0) {
+            options.merge = 1;
+        } else if (strcmp(arg, "--stats") == 0) {
+            options.stats = STATS_TEXT;
+        } else if (strcmp(arg, "--stats-json") == 0) {
+            options.stats = STATS_JSON;
+        } else if (strcmp(arg, "--bench") == 0) {
+            options.bench = 1;
+        } else if (strcmp(arg, "--checkpoint") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing file name for %s\n", arg);
+                return -1;
+            }
+            options.checkpoint = argv[++i];
+        } else if (strcmp(arg, "--max-line") == 0) {
+            char *end;
+            long n = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+            if (n < 1 || *end != '\0') {
+                fprintf(stderr, "Invalid line length for %s\n", arg);
+                return -1;
+            }
+            options.max_line = (size_t)n;
+            i++;
+        } else if (strcmp(arg, "--prefetch") == 0) {
+            char *end;
+            long n = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+            if (n < 1 || n > PREFETCH_MAX || *end != '\0') {
+                fprintf(stderr, "Invalid buffer count for %s (expected 1-%d)\n", arg, PREFETCH_MAX);
+                return -1;
+            }
+            options.prefetch = (int)n;
+            i++;
+        } else if (strcmp(arg, "--report-every") == 0) {
+            char *end;
+            long n = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+            if (n < 1 || *end != '\0') {
+                fprintf(stderr, "Invalid record count for %s\n", arg);
+                return -1;
+            }
+            options.report_every = (unsigned long)n;
+            i++;
+        } else if (strcmp(arg, "--sample") == 0) {
+            char *end;
+            double share = i + 1 < argc ? strtod(argv[i + 1], &end) : 0;
+            if (!(share > 0 && share <= 1) || *end != '\0') {
+                fprintf(stderr, "Invalid fraction for %s (expected above 0, up to 1)\n", arg);
+                return -1;
+            }
+            options.sample = share;
+            i++;
+        } else if (strcmp(arg, "--report-interval") == 0) {
+            char *end;
+            double seconds = i + 1 < argc ? strtod(argv[i + 1], &end) : 0;
+            if (!(seconds > 0) || *end != '\0') {
+                fprintf(stderr, "Invalid number of seconds for %s\n", arg);
+                return -1;
+            }
+            options.report_interval = seconds;
+            i++;
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            fprintf(stderr, "Usage: %s [-t threads] [--states codes] [--from time] [--to time]\n"
+                            "       [-g precision] [--top cells] [--quantiles] [--metrics list] [--sample fraction]\n"
+                            "       [--buckets hour|day|month] [--series file] [--series-format csv|bin]\n"
+                            "       [--format text|json|csv|bin] [--emit-partial] [--merge]\n"
+                            "       [--max-line bytes] [--columnar] [--prefetch buffers] [--build-cache] [--build-index] [--bench] [--stats] [--stats-json]\n"
+                            "       [--checkpoint file] [--report-every records] [--report-interval seconds] file...\n",
+                    argv[0]);
+            return -1;
+        } else {
+            files[num_files++] = argv[i];
         }
     }
 
-    return EXIT_SUCCESS;
+    // The aggregates take the place of the report on stdout, and nothing else may go there
+    if (options.format != FORMAT_TEXT &&
+        (options.geohash || options.quantiles || (options.buckets && options.series_path == NULL))) {
+        fprintf(stderr, "-g, --quantiles and --buckets without --series print after the report, "
+                        "so they need --format text\n");
+        return -1;
+    }
+    // Partials only hold the state aggregates
+    if (options.merge && (options.geohash || options.quantiles || options.buckets ||
+                          options.build_cache || options.build_index || options.bench ||
+                          options.checkpoint != NULL)) {
+        fprintf(stderr, "--merge does not go with -g, --quantiles, --buckets, --build-cache, "
+                        "--build-index, --bench or --checkpoint\n");
+        return -1;
+    }
+    // Caches, indexes and checkpoints stand in for the whole file in later runs
+    if (options.max_line > 0 && (options.build_cache || options.build_index || options.checkpoint != NULL)) {
+        fprintf(stderr, "--max-line does not go with --build-cache, --build-index or --checkpoint\n");
+        return -1;
+    }
+    // Only the report knows the counts of a sample are estimates
+    if (options.sample > 0 && (options.format != FORMAT_TEXT || options.merge || options.geohash ||
+                               options.buckets || options.prefetch || options.build_cache ||
+                               options.build_index || options.bench || options.checkpoint != NULL)) {
+        fprintf(stderr, "--sample does not go with --format, --merge, -g, --buckets, --prefetch, "
+                        "--build-cache, --build-index, --bench or --checkpoint\n");
+        return -1;
+    }
+    return num_files;
+}
+
+/*
+ * Task pool shared by every parallel step: the files, the chunks of a file,
+ * the parts of a compressed file and the shards of a report. Each of the
+ * --threads workers (worker 0 is the thread that started the pool) owns a
+ * deque of tasks. A worker runs its newest task first and, when it has none
+ * left, steals the oldest task of another worker. Work is handed in as a
+ * group of small tasks, and a thread waiting for its group runs queued tasks
+ * meanwhile, so a file task splits into chunk tasks without holding on to a
+ * thread, and one big file of a skewed set ends up spread over all cores.
+ */
+
+struct task_group;
+
+struct task {
+    void (*run)(void *arg);
+    void *arg;
+    struct task_group *group;
+};
+
+// Tasks submitted to a group and not finished yet, guarded by the pool lock
+struct task_group {
+    size_t pending;
+};
+
+// One worker's queued tasks, tasks[head..tail): the owner pops at the tail, thieves at the head
+struct task_deque {
+    pthread_mutex_t lock;
+    struct task *tasks;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+};
+
+struct task_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;  // A task was queued, a group finished or the pool is stopping
+    size_t queued;        // Tasks in all the deques
+    int stopping;
+    int num_workers;      // 0 = not started
+    int num_started;      // Threads running pool_worker, workers 1 to num_started
+    pthread_key_t self;   // The calling thread's deque, NULL outside the pool
+    pthread_t threads[MAX_THREADS];
+    struct task_deque deques[MAX_THREADS];
+};
+
+static struct task_pool pool;
+
+// The deque tasks submitted by this thread go to; threads outside the pool use worker 0's
+static struct task_deque *own_deque(void) {
+    struct task_deque *deque = pthread_getspecific(pool.self);
+    return deque != NULL ? deque : &pool.deques[0];
 }
 
-// Modified analyze_file to return an error code
-int analyze_file(FILE *file, struct climate_info **states, int num_states) {
-    if (file == NULL || states == NULL || num_states <= 0) {
-        return -1;  // Invalid parameters
+// Takes the newest task of mine or else the oldest one of another worker; returns 1 if found
+static int take_task(struct task_deque *mine, struct task *task) {
+    int first = (int)(mine - pool.deques);
+    for (int k = 0; k < pool.num_workers; k++) {
+        struct task_deque *deque = &pool.deques[(first + k) % pool.num_workers];
+        pthread_mutex_lock(&deque->lock);
+        int found = deque->head < deque->tail;
+        if (found) {
+            *task = k == 0 ? deque->tasks[--deque->tail] : deque->tasks[deque->head++];
+            if (deque->head == deque->tail) {
+                deque->head = deque->tail = 0;
+            }
+        }
+        pthread_mutex_unlock(&deque->lock);
+        if (found) {
+            pthread_mutex_lock(&pool.lock);
+            pool.queued--;
+            pthread_mutex_unlock(&pool.lock);
+            return 1;
+        }
     }
+    return 0;
+}
 
-    char line[LINE_BUFFER];
-    int lines_processed = 0;
+static void run_task(const struct task *task) {
+    task->run(task->arg);
+    pthread_mutex_lock(&pool.lock);
+    if (--task->group->pending == 0) {
+        pthread_cond_broadcast(&pool.wake);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
 
-    while (fgets(line, LINE_BUFFER, file) != NULL) {
-        // Check for line length overflow
-        if (strlen(line) >= LINE_BUFFER - 1) {
-            //fprintf(stderr, "Warning: Skipping line due to length overflow\n");
-            continue;
+// Adds run(arg) to group; it runs right here if it cannot be queued
+static void submit_task(struct task_group *group, void (*run)(void *arg), void *arg) {
+    struct task task = { run, arg, group };
+    pthread_mutex_lock(&pool.lock);
+    group->pending++;
+    pool.queued++;
+    pthread_cond_signal(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    struct task_deque *deque = own_deque();
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity && deque->head > 0) {
+        memmove(deque->tasks, deque->tasks + deque->head,
+                (deque->tail - deque->head) * sizeof(struct task));
+        deque->tail -= deque->head;
+        deque->head = 0;
+    }
+    if (deque->tail == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+        struct task *bigger = realloc(deque->tasks, capacity * sizeof(struct task));
+        if (bigger != NULL) {
+            deque->tasks = bigger;
+            deque->capacity = capacity;
         }
+    }
+    int queued = deque->tail < deque->capacity;
+    if (queued) {
+        deque->tasks[deque->tail++] = task;
+    }
+    pthread_mutex_unlock(&deque->lock);
 
-        char state_code[3];
-        unsigned long long timestamp;
-        char geohash[13];
-        double humidity, snow, cloudcover, lightning, pressure, temperature;
-        
-        // Parse line using tab as delimiter
-        if (sscanf(line, "%2s\t%llu\t%12s\t%lf\t%lf\t%lf\t%lf\t%lf\t%lf",
-                state_code, &timestamp, geohash, &humidity, &snow,
-                &cloudcover, &lightning, &pressure, &temperature) != 9)
-        {
-            //fprintf(stderr, "Warning: Skipping malformed line\n");
+    if (!queued) {
+        pthread_mutex_lock(&pool.lock);
+        pool.queued--;
+        pthread_mutex_unlock(&pool.lock);
+        run_task(&task);
+    }
+}
+
+// Runs queued tasks, of any group, until every task of group has finished
+static void wait_group(struct task_group *group) {
+    struct task_deque *mine = own_deque();
+    struct task task;
+    for (;;) {
+        if (take_task(mine, &task)) {
+            run_task(&task);
             continue;
         }
+        pthread_mutex_lock(&pool.lock);
+        while (group->pending > 0 && pool.queued == 0) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        int done = group->pending == 0;
+        pthread_mutex_unlock(&pool.lock);
+        if (done) {
+            return;
+        }
+    }
+}
 
-        // Validate data ranges
-        if (humidity < 0 || humidity > 100 || 
-            cloudcover < 0 || cloudcover > 100 || 
-            temperature < 0) {  // Kelvin can't be negative
-            //fprintf(stderr, "Warning: Skipping line with invalid data ranges\n");
+static void *pool_worker(void *arg) {
+    struct task_deque *mine = arg;
+    pthread_setspecific(pool.self, mine);
+    struct task task;
+    for (;;) {
+        if (take_task(mine, &task)) {
+            run_task(&task);
             continue;
         }
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.stopping && pool.queued == 0) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        int stop = pool.stopping && pool.queued == 0;
+        pthread_mutex_unlock(&pool.lock);
+        if (stop) {
+            return NULL;
+        }
+    }
+}
 
-        // Find or create state entry
-        int state_idx = -1;
-        for (int i = 0; i < num_states; i++) {
-            if (states[i] != NULL && strcmp(states[i]->code, state_code) == 0) {
-                state_idx = i;
-                break;
-            } else if (states[i] == NULL) {
-                state_idx = i;
-                states[i] = calloc(1, sizeof(struct climate_info));
-                if (states[i] == NULL) {
-                    fprintf(stderr, "Error: Memory allocation failed\n");
-                    return -1;
+/*
+ * Starts a pool of num_workers workers with the calling thread as worker 0.
+ * Workers whose thread cannot be created are simply missing; with none at
+ * all the tasks run on the threads that wait for them. Returns 0 on success.
+ */
+static int start_pool(int num_workers) {
+    memset(&pool, 0, sizeof(pool));
+    if (pthread_mutex_init(&pool.lock, NULL) != 0) {
+        return -1;
+    }
+    if (pthread_cond_init(&pool.wake, NULL) != 0) {
+        pthread_mutex_destroy(&pool.lock);
+        return -1;
+    }
+    if (pthread_key_create(&pool.self, NULL) != 0) {
+        pthread_cond_destroy(&pool.wake);
+        pthread_mutex_destroy(&pool.lock);
+        return -1;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    }
+    pool.num_workers = num_workers;
+    pthread_setspecific(pool.self, &pool.deques[0]);
+    while (pool.num_started + 1 < num_workers &&
+           pthread_create(&pool.threads[pool.num_started + 1], NULL, pool_worker,
+                          &pool.deques[pool.num_started + 1]) == 0) {
+        pool.num_started++;
+    }
+    return 0;
+}
+
+// Lets the workers finish the queued tasks and stops them
+static void stop_pool(void) {
+    if (pool.num_workers == 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 1; i <= pool.num_started; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    for (int i = 0; i < pool.num_workers; i++) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+    }
+    pthread_setspecific(pool.self, NULL);
+    pthread_key_delete(pool.self);
+    pthread_cond_destroy(&pool.wake);
+    pthread_mutex_destroy(&pool.lock);
+    pool.num_workers = 0;
+}
+
+// One input file and the private table it is analyzed into
+struct file_job {
+    const char *path;
+    struct state_table table;
+    int status;  // 0 = analyzed, 1 = could not open, 2 = processing error
+    struct file_checkpoint *resume;  // Checkpoint mode: the previous entry, if any
+    struct file_checkpoint saved;    // Checkpoint mode: the new entry, if has_saved
+    int has_saved;
+};
+
+static int analyze_incremental(struct file_job *job);
+static void free_checkpoint(struct checkpoint *ckpt);
+
+static void file_task(void *arg) {
+    struct file_job *job = arg;
+    int result = options.checkpoint != NULL ? analyze_incremental(job)
+                                            : analyze_path(job->path, &job->table);
+    job->status = result == 0 ? 0 : (result == -2 ? 1 : 2);
+}
+
+/*
+ * Analyzes every file into table and returns how many were processed.
+ * Every file is a task of the pool, analyzed into its own table (large ones
+ * split further into chunk tasks); the tables are then merged and the errors
+ * reported in argv order, so the output is the same as processing the files
+ * one after another.
+ */
+int analyze_files(char *files[], int num_files, struct state_table *table) {
+    struct file_job *jobs = calloc((size_t)num_files, sizeof(struct file_job));
+    if (jobs == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 0;
+    }
+
+    for (int i = 0; i < num_files; i++) {
+        jobs[i].path = files[i];
+    }
+
+    struct checkpoint ckpt = { NULL, 0 };
+    if (options.checkpoint != NULL) {
+        load_checkpoint(options.checkpoint, &ckpt);
+        for (uint32_t c = 0; c < ckpt.num_files; c++) {
+            for (int i = 0; i < num_files; i++) {
+                if (jobs[i].resume == NULL && strcmp(ckpt.files[c].path, files[i]) == 0) {
+                    jobs[i].resume = &ckpt.files[c];
+                    break;
+                }
+            }
+        }
+    }
+
+    struct task_group group = { 0 };
+    for (int i = 0; i < num_files; i++) {
+        submit_task(&group, file_task, &jobs[i]);
+    }
+    wait_group(&group);
+
+    if (options.checkpoint != NULL) {
+        // This run's entries replace the old ones; files not given keep theirs
+        struct checkpoint next = { NULL, 0 };
+        next.files = calloc(ckpt.num_files + (uint32_t)num_files, sizeof(*next.files));
+        if (next.files != NULL) {
+            for (uint32_t c = 0; c < ckpt.num_files; c++) {
+                int replaced = 0;
+                for (int i = 0; i < num_files; i++) {
+                    replaced |= jobs[i].has_saved && strcmp(jobs[i].path, ckpt.files[c].path) == 0;
+                }
+                if (!replaced) {
+                    next.files[next.num_files++] = ckpt.files[c];
+                }
+            }
+            for (int i = 0; i < num_files; i++) {
+                int duplicate = 0;
+                for (int j = 0; j < i; j++) {
+                    duplicate |= jobs[j].has_saved && strcmp(jobs[j].path, jobs[i].path) == 0;
+                }
+                if (jobs[i].has_saved && !duplicate) {
+                    next.files[next.num_files] = jobs[i].saved;
+                    next.files[next.num_files++].path = (char *)jobs[i].path;
                 }
-                strncpy(states[i]->code, state_code, 2);
-                states[i]->code[2] = '\0';
-                states[i]->max_temp = -DBL_MAX;
-                states[i]->min_temp = DBL_MAX;
-                break;
             }
+            save_checkpoint(options.checkpoint, &next);
+            free(next.files);
+        } else {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+        }
+        for (int i = 0; i < num_files; i++) {
+            free_states(&jobs[i].saved.table);
         }
+        free_checkpoint(&ckpt);
+    }
 
-        if (state_idx == -1) {
-            //fprintf(stderr, "Warning: No space for new state\n");
+    int files_processed = 0;  // Track if any files were successfully processed
+    for (int i = 0; i < num_files; i++) {
+        struct file_job *job = &jobs[i];
+        if (job->status == 1) {
+            fprintf(stderr, "Unable to open file: %s\n", job->path);
             continue;
         }
 
-        // Update state info
-        struct climate_info *info = states[state_idx];
-        info->num_records++;
-        info->sum_temperature += temperature;
-        info->sum_humidity += humidity;
-        info->sum_cloudcover += cloudcover;
-        info->lightning_strikes += (lightning > 0 ? 1 : 0);
-        info->snow_records += (snow > 0 ? 1 : 0);
+        int ok = job->status == 0 && merge_states(table, &job->table) > 0;
+        free_states(&job->table);
 
-        if (temperature > info->max_temp) {
-            info->max_temp = temperature;
-            info->max_temp_time = timestamp / 1000;
-        }
-        if (temperature < info->min_temp) {
-            info->min_temp = temperature;
-            info->min_temp_time = timestamp / 1000;
+        if (ok) {
+            files_processed++;
+        } else {
+            fprintf(stderr, "Error processing file: %s\n", job->path);
         }
-
-        lines_processed++;
     }
 
-    return (lines_processed > 0) ? 0 : -1;  // Return success if any lines were processed
+    free(jobs);
+    return files_processed;
 }
 
-// method to print the summary for each state
-void print_report(struct climate_info *states[], int num_states) {
-    printf("States found: ");  // Changed to avoid extra newline
-    int i;
-    for (i = 0; i < num_states; ++i) {
-        if (states[i] != NULL) {
-            printf("%s ", states[i]->code);
-        }
-    }
-    printf("\n");
-
-    for (i = 0; i < num_states; i++) {  // Changed to reuse existing i variable
-        if (states[i] == NULL) continue;
-
-        struct climate_info *info = states[i];
-        printf("-- State: %s --\n", info->code);
-        printf("Number of Records: %lu\n", info->num_records);
-        printf("Average Humidity: %.1Lf%%\n", info->sum_humidity / info->num_records);
-        printf("Average Temperature: %.1LfF\n", 
-               (info->sum_temperature / info->num_records - 273.15) * 9/5 + 32);
-        printf("Max Temperature: %.1LfF\n", 
-               (info->max_temp - 273.15) * 9/5 + 32);
-        printf("Max Temperature on: %s", ctime(&info->max_temp_time));
-        printf("Min Temperature: %.1LfF\n",
-               (info->min_temp - 273.15) * 9/5 + 32);
-        printf("Min Temperature on: %s", ctime(&info->min_temp_time));
-        printf("Lightning Strikes: %lu\n", info->lightning_strikes);
-        printf("Records with Snow Cover: %lu\n", info->snow_records);
-        printf("Average Cloud Cover: %.1Lf%%\n", info->sum_cloudcover / info->num_records);
+/*
+ * Analyzes the file at path. Runs with --from, --to or --states go through
+ * an up-to-date index sidecar (path.tdvi) if there is one; otherwise a valid
+ * binary cache is preferred (the path itself or its .tdvc sidecar). Returns
+ * 0 on success, -1 if no line could be used and -2 if the file could not be
+ * opened.
+ */
+int analyze_path(const char *path, struct state_table *table) {
+    if (strcmp(path, "-") == 0) {
+        return analyze_file(stdin, table);
+    }
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -2;
+    }
+
+    // Filtered runs only read the lines an up-to-date index points to
+    struct index_map index;
+    if ((options.filter_states || options.filter_time) &&
+        open_index(path, fileno(file), &index) == 0) {
+        int result = analyze_indexed(file, &index, table);
+        close_index(&index);
+        fclose(file);
+        return result;
+    }
+
+    // Caches hold no geohashes or line lengths, so -g and --max-line only
+    // take a cache given directly
+    struct cache_map cache;
+    int result;
+    int direct = options.geohash || options.max_line > 0;
+    int cached = direct ? map_cache(fileno(file), &cache) : open_cache(path, fileno(file), &cache);
+    if (cached == 0) {
+        if (options.geohash) {
+            fprintf(stderr, "Warning: No geohash cells for cache file: %s\n", path);
+        }
+        if (options.max_line > 0) {
+            fprintf(stderr, "Warning: No line lengths for cache file: %s\n", path);
+        }
+        result = analyze_cache(&cache, table);
+        close_cache(&cache);
+    } else {
+        result = analyze_file(file, table);
+    }
+    fclose(file);
+    return result;
+}
+
+/*
+ * Checkpoints (--checkpoint FILE) for append-only inputs. For each file, a
+ * checkpoint keeps that file's aggregate table together with the byte
+ * offset up to which it has been consumed. A later run resumes the table
+ * and parses only the bytes appended since. The offset always sits right
+ * after a newline: an unterminated last line still counts for the current
+ * report, but it is parsed again on the next run once it is complete.
+ * A file that was replaced, truncated or changed in its first or last
+ * CHECKPOINT_FINGERPRINT consumed bytes is parsed from the start again;
+ * edits in between are not noticed, as that would mean reading it all.
+ *
+ * Layout (native byte order): struct checkpoint_header, then for every file
+ * a struct checkpoint_entry, its path and num_states struct state_records.
+ */
+
+// FNV-1a over the first bytes and those just before the consumed offset, to notice rewritten files
+static uint64_t checkpoint_fingerprint(const char *data, uint64_t offset) {
+    uint64_t head = offset < CHECKPOINT_FINGERPRINT ? offset : CHECKPOINT_FINGERPRINT;
+    uint64_t from = offset > CHECKPOINT_FINGERPRINT ? offset - CHECKPOINT_FINGERPRINT : 0;
+    if (from < head) {
+        from = head;  // The ranges overlap in short files
+    }
+    uint64_t hash = 1469598103934665603ULL;
+    for (uint64_t i = 0; i < head; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    for (uint64_t i = from; i < offset; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Writes the states of table as state_records; returns 0 on success
+static int write_states(FILE *out, const struct state_table *table) {
+    for (int i = 0; i < table->num_states; i++) {
+        const struct climate_info *info = table->states[i];
+        struct state_record record;
+        memset(&record, 0, sizeof(record));
+        memcpy(record.code, info->code, sizeof(info->code));
+        record.num_records = info->num_records;
+        record.lightning_strikes = lightning_count(info);
+        record.snow_records = snow_count(info);
+        record.max_temp_time = (int64_t)info->max_temp_time;
+        record.min_temp_time = (int64_t)info->min_temp_time;
+        record.sum_temperature = info->sum_temperature;
+        record.temperature_error = info->temperature_error;
+        record.sum_humidity = info->sum_humidity;
+        record.humidity_error = info->humidity_error;
+        record.sum_cloudcover = info->sum_cloudcover;
+        record.cloudcover_error = info->cloudcover_error;
+        record.max_temp = info->max_temp;
+        record.min_temp = info->min_temp;
+        record.dew_point_records = info->dew_point_records;
+        record.sum_pressure = info->sum_pressure;
+        record.sum_dew_point = info->sum_dew_point;
+        record.sum_heat_index = info->sum_heat_index;
+        if (fwrite(&record, sizeof(record), 1, out) != 1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Reads count state_records into the (empty) table; returns 0 on success
+static int read_states(FILE *in, uint32_t count, struct state_table *table) {
+    for (uint32_t i = 0; i < count; i++) {
+        struct state_record record;
+        if (fread(&record, sizeof(record), 1, in) != 1 || record.code[2] != '\0') {
+            return -1;
+        }
+        int slot = find_state(table, record.code);
+        if (slot < 0 || table->states[slot]->num_records != 0) {
+            return -1;  // No memory, or a duplicate code: not something we wrote
+        }
+        struct climate_info *info = table->states[slot];
+        info->num_records = (unsigned long)record.num_records;
+        add_count(&info->lightning_strikes, &info->lightning_high, record.lightning_strikes);
+        add_count(&info->snow_records, &info->snow_high, record.snow_records);
+        info->max_temp_time = (time_t)record.max_temp_time;
+        info->min_temp_time = (time_t)record.min_temp_time;
+        info->sum_temperature = record.sum_temperature;
+        info->temperature_error = record.temperature_error;
+        info->sum_humidity = record.sum_humidity;
+        info->humidity_error = record.humidity_error;
+        info->sum_cloudcover = record.sum_cloudcover;
+        info->cloudcover_error = record.cloudcover_error;
+        info->max_temp = record.max_temp;
+        info->min_temp = record.min_temp;
+        info->dew_point_records = (unsigned long)record.dew_point_records;
+        info->sum_pressure = record.sum_pressure;
+        info->sum_dew_point = record.sum_dew_point;
+        info->sum_heat_index = record.sum_heat_index;
+    }
+    return 0;
+}
+
+static void free_checkpoint(struct checkpoint *ckpt) {
+    for (uint32_t i = 0; i < ckpt->num_files; i++) {
+        free(ckpt->files[i].path);
+        free_states(&ckpt->files[i].table);
+    }
+    free(ckpt->files);
+    ckpt->files = NULL;
+    ckpt->num_files = 0;
+}
+
+/*
+ * Loads the checkpoint at path into ckpt. A missing file is an empty
+ * checkpoint; an unreadable or foreign one, or one kept with other
+ * --metrics, is reported and ignored, which just means every file is parsed
+ * from the start.
+ */
+int load_checkpoint(const char *path, struct checkpoint *ckpt) {
+    ckpt->files = NULL;
+    ckpt->num_files = 0;
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        return 0;
+    }
+
+    struct checkpoint_header header;
+    int ok = fread(&header, sizeof(header), 1, in) == 1 &&
+             memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0 &&
+             header.version == CHECKPOINT_VERSION && header.byte_order == CACHE_BYTE_ORDER &&
+             header.record_size == sizeof(struct state_record);
+    if (ok && header.metrics != options.metrics) {
+        fprintf(stderr, "Warning: Ignoring checkpoint kept with other --metrics: %s\n", path);
+        fclose(in);
+        return 0;
+    }
+    ok = ok && (ckpt->files = calloc(header.num_files + 1, sizeof(*ckpt->files))) != NULL;
+    for (uint32_t i = 0; ok && i < header.num_files; i++) {
+        struct file_checkpoint *file = &ckpt->files[i];
+        struct checkpoint_entry entry;
+        ok = fread(&entry, sizeof(entry), 1, in) == 1 && entry.path_len < 65536 &&
+             (file->path = malloc(entry.path_len + 1)) != NULL &&
+             fread(file->path, 1, entry.path_len, in) == entry.path_len;
+        ckpt->num_files = i + 1;
+        if (ok) {
+            file->path[entry.path_len] = '\0';
+            file->entry = entry;
+            ok = read_states(in, entry.num_states, &file->table) == 0;
+        }
+    }
+    fclose(in);
+
+    if (!ok) {
+        fprintf(stderr, "Warning: Ignoring unreadable checkpoint: %s\n", path);
+        free_checkpoint(ckpt);
+    }
+    return 0;
+}
+
+/*
+ * Combines the partials at files[] into table in argument order and returns
+ * how many were read. merge_states folds each one in as the data after the
+ * ones before it, just as analyze_files folds the tables of its files, so
+ * the result is that of one run over the partials' inputs in this order
+ * (states in first-seen order, the earlier time of equal extremes). The
+ * fold is associative: partials of merged partials give the same aggregates.
+ * Each partial must have been kept with (at least) the --metrics of this
+ * run. A partial that cannot be read is reported and left out.
+ */
+int merge_partials(char *files[], int num_files, struct state_table *table) {
+    int processed = 0;
+    for (int i = 0; i < num_files; i++) {
+        FILE *in = fopen(files[i], "rb");
+        if (in == NULL) {
+            fprintf(stderr, "Unable to open file: %s\n", files[i]);
+            continue;
+        }
+        static struct state_table part;  // One at a time, emptied by free_states
+        struct aggregate_header header;
+        int ok = fread(&header, sizeof(header), 1, in) == 1 &&
+                 memcmp(header.magic, AGGREGATE_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == AGGREGATE_VERSION && header.byte_order == CACHE_BYTE_ORDER &&
+                 header.record_size == sizeof(struct state_record) &&
+                 (header.metrics & options.metrics) == options.metrics &&
+                 read_states(in, header.num_states, &part) == 0 && fgetc(in) == EOF;
+        fclose(in);
+        if (ok) {
+            for (int j = 0; j < part.num_states; j++) {
+                part.stats.used += part.states[j]->num_records;
+            }
+            ok = merge_states(table, &part) >= 0;
+        }
+        free_states(&part);
+        if (!ok) {
+            fprintf(stderr, "Error processing file: %s\n", files[i]);
+            continue;
+        }
+        processed++;
+    }
+    return processed;
+}
+
+/*
+ * Writes the checkpoint: the entries of this run's files, plus the ones of
+ * files that were not part of this run. Goes through a temporary file that
+ * is renamed into place.
+ */
+int save_checkpoint(const char *path, const struct checkpoint *ckpt) {
+    size_t path_len = strlen(path);
+    char *tmp_path = malloc(path_len + 5);
+    if (tmp_path == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+
+    struct checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.byte_order = CACHE_BYTE_ORDER;
+    header.record_size = sizeof(struct state_record);
+    header.metrics = options.metrics;
+    for (uint32_t i = 0; i < ckpt->num_files; i++) {
+        header.num_files += ckpt->files[i].path != NULL;
+    }
+
+    FILE *out = fopen(tmp_path, "wb");
+    int ok = out != NULL && fwrite(&header, sizeof(header), 1, out) == 1;
+    for (uint32_t i = 0; ok && i < ckpt->num_files; i++) {
+        const struct file_checkpoint *file = &ckpt->files[i];
+        if (file->path == NULL) {
+            continue;  // Replaced by this run's entry
+        }
+        struct checkpoint_entry entry = file->entry;
+        entry.path_len = (uint32_t)strlen(file->path);
+        entry.num_states = (uint32_t)file->table.num_states;
+        ok = fwrite(&entry, sizeof(entry), 1, out) == 1 &&
+             fwrite(file->path, 1, entry.path_len, out) == entry.path_len &&
+             write_states(out, &file->table) == 0;
+    }
+    if (out != NULL && fclose(out) != 0) {
+        ok = 0;
+    }
+    if (ok) {
+        ok = rename(tmp_path, path) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Unable to write checkpoint: %s\n", path);
+        remove(tmp_path);
+    }
+    free(tmp_path);
+    return ok ? 0 : -1;
+}
+
+/*
+ * Analyzes a file in checkpoint mode. job->resume, if set, is the file's
+ * previous checkpoint entry; its table is taken over when the file still
+ * looks like the one it was taken from (same device and inode, at least as
+ * long, same bytes before the offset). Fills in job->saved with the new
+ * entry, except under --states, --from or --to: a filtered table is not the
+ * file's, so the previous entry is kept as it was. Returns like analyze_path.
+ */
+static int analyze_incremental(struct file_job *job) {
+    if (strcmp(job->path, "-") == 0) {
+        return analyze_file(stdin, &job->table);
+    }
+
+    FILE *file = fopen(job->path, "r");
+    if (file == NULL) {
+        return -2;
+    }
+    struct stat st;
+    size_t size = 0;
+    char *data = fstat(fileno(file), &st) == 0 ? map_file(file, &size) : NULL;
+    if (data != NULL && compression_of(data, size) != COMPRESSION_NONE) {
+        munmap(data, size);
+        data = NULL;
+    }
+    if (data == NULL) {
+        // Pipes, empty and compressed files are analyzed as usual and not checkpointed
+        int result = analyze_file(file, &job->table);
+        fclose(file);
+        return result;
+    }
+    fclose(file);
+
+    uint64_t offset = 0;
+    struct file_checkpoint *resume = job->resume;
+    int filtered = options.filter_states || options.filter_time;
+    if (resume != NULL && options.geohash == 0 && options.buckets == 0 && !options.quantiles && !filtered &&
+        resume->entry.device == (uint64_t)st.st_dev &&
+        resume->entry.inode == (uint64_t)st.st_ino && resume->entry.offset <= size &&
+        resume->entry.fingerprint == checkpoint_fingerprint(data, resume->entry.offset)) {
+        job->table = resume->table;
+        memset(&resume->table, 0, sizeof(resume->table));
+        offset = resume->entry.offset;
+    }
+
+    // Only complete lines go into the checkpoint
+    size_t complete = size;
+    while (complete > offset && data[complete - 1] != '\n') {
+        complete--;
+    }
+
+    long result = analyze_range(data + offset, complete - offset, &job->table);
+    if (result >= 0 && !filtered && copy_states(&job->saved.table, &job->table) == 0) {
+        job->has_saved = 1;
+        job->saved.entry.device = (uint64_t)st.st_dev;
+        job->saved.entry.inode = (uint64_t)st.st_ino;
+        job->saved.entry.offset = complete;
+        job->saved.entry.fingerprint = checkpoint_fingerprint(data, complete);
+    }
+    if (result >= 0 && complete < size) {
+        result = analyze_range(data + complete, size - complete, &job->table);
+    }
+    munmap(data, size);
+
+    if (result < 0) {
+        return -1;
+    }
+    unsigned long total = 0;
+    for (int i = 0; i < job->table.num_states; i++) {
+        total += job->table.states[i]->num_records;
+    }
+    return (total > 0) ? 0 : -1;  // Return success if the file has any lines in total
+}
+
+// Modified analyze_file to return an error code
+int analyze_file(FILE *file, struct state_table *table) {
+    if (file == NULL || table == NULL) {
+        return -1;  // Invalid parameters
+    }
+
+    // With --prefetch, regular files are read ahead into buffers instead of mapped
+    if (options.prefetch > 0) {
+        long result = analyze_prefetched(file, table);
+        if (result != -2) {
+            return (result > 0) ? 0 : -1;
+        }
+    }
+
+    // Regular files are mapped and scanned in place; pipes fall back to stdio
+    size_t size;
+    void *data = map_file(file, &size);
+    if (data != NULL) {
+        int kind = compression_of(data, size);
+        int result;
+        if (kind != COMPRESSION_NONE) {
+            result = analyze_compressed(data, size, kind, table) > 0 ? 0 : -1;
+        } else if (options.sample > 0) {
+            result = analyze_sampled(data, size, table) > 0 ? 0 : -1;
+        } else {
+            result = analyze_buffer(data, size, table);
+        }
+        munmap(data, size);
+        return result;
+    }
+
+    struct columnar_buffer *columns = NULL;
+    if (options.columnar && (columns = new_columns()) == NULL) {
+        return -1;
+    }
+
+    // Streams may hand out rolling reports while they are read
+    struct reporter reporter;
+    int reporting = (options.report_every > 0 || options.report_interval > 0) &&
+                    start_reporter(&reporter) == 0;
+    unsigned long next_report = options.report_every;
+    struct timespec last_report;
+    clock_gettime(CLOCK_MONOTONIC, &last_report);
+
+    // Lines are cut out of large reads; only an unfinished one is moved to the front
+    size_t capacity = STREAM_BUFFER;
+    size_t buffered = 0;
+    char *buffer = malloc(capacity);
+    unsigned long lines_processed = 0;
+    int failed = buffer == NULL;
+    int eof = 0;
+    int skipping = 0;  // Dropping the rest of a line already over --max-line
+    struct scan_stats *stats = &table->stats;
+    uint64_t start = stage_clock();
+    uint64_t staged = staged_ticks(stats);
+    if (failed) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+    }
+
+    while (!failed && !eof) {
+        if (buffered == capacity && options.max_line > 0 && buffered > options.max_line) {
+            // The unfinished line is too long already: no need to keep it
+            skipping = 1;
+            buffered = 0;
+        }
+        if (buffered == capacity) {
+            char *bigger = realloc(buffer, capacity * 2);
+            if (bigger == NULL) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                failed = 1;
+                break;
+            }
+            buffer = bigger;
+            capacity *= 2;
+        }
+        ssize_t n = read(fileno(file), buffer + buffered, capacity - buffered);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            fprintf(stderr, "Error: Read failed\n");
+            failed = 1;
+            break;
+        }
+        eof = n == 0;
+        size_t seen = buffered;
+        buffered += (size_t)n;
+        stats->bytes += (uint64_t)n;
+
+        if (skipping) {
+            const char *newline = memchr(buffer + seen, '\n', buffered - seen);
+            if (newline == NULL && !eof) {
+                buffered = 0;
+                continue;
+            }
+            stats->lines++;
+            stats->skipped[SKIP_TOO_LONG]++;
+            size_t rest = newline != NULL ? (size_t)(buffer + buffered - newline) - 1 : 0;
+            memmove(buffer, buffer + buffered - rest, rest);
+            buffered = rest;
+            seen = 0;
+            skipping = 0;
+        }
+
+        // The bytes before seen are an unfinished line, so only the new ones can end one
+        const char *p = buffer;
+        const char *end = buffer + buffered;
+        while (!eof && end > buffer + seen && end[-1] != '\n') {
+            end--;
+        }
+        if (!eof && end == buffer + seen) {
+            end = p;
+        }
+        while (p < end) {
+            const char *line;
+            size_t len;
+            if (!next_line(&p, end, &line, &len)) {
+                stats->lines++;
+                stats->skipped[SKIP_TOO_LONG]++;
+                continue;
+            }
+
+            int result = process_line(line, len, table, columns);
+            if (result < 0) {
+                failed = 1;
+                break;
+            }
+            lines_processed += (unsigned long)result;
+
+            if (reporting && next_report > 0 && lines_processed >= next_report &&
+                report_now(&reporter, table, columns, lines_processed, &next_report, &last_report) != 0) {
+                failed = 1;
+                break;
+            }
+        }
+
+        // The clock is read once per read, so a slow feed still gets its timed reports
+        if (reporting && !failed && !eof && options.report_interval > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double elapsed = (double)(now.tv_sec - last_report.tv_sec) +
+                             (double)(now.tv_nsec - last_report.tv_nsec) / 1e9;
+            if (elapsed >= options.report_interval &&
+                report_now(&reporter, table, columns, lines_processed, &next_report, &last_report) != 0) {
+                failed = 1;
+            }
+        }
+        buffered -= (size_t)(p - buffer);
+        memmove(buffer, p, buffered);
+    }
+    free(buffer);
+
+    if (reporting) {
+        stop_reporter(&reporter);
+    }
+    if (columns != NULL) {
+        if (!failed) {
+            uint64_t flush_start = stage_clock();
+            failed = flush_columns(table, columns) != 0;
+            stats->ticks[STAGE_AGGREGATE] += stage_clock() - flush_start;
+        }
+        free_columns(columns);
+    }
+    charge_read(stats, start, staged);
+    if (failed) {
+        return -1;
+    }
+    return (lines_processed > 0) ? 0 : -1;  // Return success if any lines were processed
+}
+
+// Prints the snapshots handed over by publish_report until the stream ends
+static void *report_worker(void *arg) {
+    struct reporter *reporter = arg;
+    struct climate_info *states = NULL;
+    struct climate_info **view = NULL;
+    size_t max_states = 0, max_view = 0;
+
+    pthread_mutex_lock(&reporter->lock);
+    for (;;) {
+        while (!reporter->pending && !reporter->done) {
+            pthread_cond_wait(&reporter->wake, &reporter->lock);
+        }
+        if (!reporter->pending) {
+            break;
+        }
+        int num_states = reporter->num_states;
+        unsigned long records = reporter->records;
+        struct climate_info *grown = reserve_array(states, &max_states, (size_t)num_states,
+                                                   sizeof(*states));
+        struct climate_info **grown_view = grown != NULL ?
+            reserve_array(view, &max_view, (size_t)num_states, sizeof(*view)) : NULL;
+        reporter->pending = 0;
+        if (grown != NULL) states = grown;
+        if (grown_view == NULL) {
+            continue;  // No room for this snapshot; wait for the next one
+        }
+        view = grown_view;
+        memcpy(states, reporter->states, (size_t)num_states * sizeof(states[0]));
+        pthread_mutex_unlock(&reporter->lock);
+
+        // Printing may block on a slow reader, so it happens outside the lock
+        for (int i = 0; i < num_states; i++) {
+            view[i] = &states[i];
+        }
+        printf("Rolling report after %lu records\n", records);
+        print_report(view, num_states);
+        fflush(stdout);
+
+        pthread_mutex_lock(&reporter->lock);
+    }
+    pthread_mutex_unlock(&reporter->lock);
+    free(states);
+    free(view);
+    return NULL;
+}
+
+// Starts the report thread; returns 0 on success
+static int start_reporter(struct reporter *reporter) {
+    reporter->pending = 0;
+    reporter->done = 0;
+    reporter->num_states = 0;
+    reporter->max_states = 0;
+    reporter->states = NULL;
+    if (pthread_mutex_init(&reporter->lock, NULL) != 0) {
+        return -1;
+    }
+    if (pthread_cond_init(&reporter->wake, NULL) != 0) {
+        pthread_mutex_destroy(&reporter->lock);
+        return -1;
+    }
+    if (pthread_create(&reporter->thread, NULL, report_worker, reporter) != 0) {
+        fprintf(stderr, "Warning: Unable to start report thread\n");
+        pthread_cond_destroy(&reporter->wake);
+        pthread_mutex_destroy(&reporter->lock);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Copies the table into the reporter's snapshot and wakes the report thread.
+ * Ingestion only waits for the copy: if the previous snapshot is still being
+ * printed, the new one simply replaces any snapshot not yet picked up.
+ */
+static void publish_report(struct reporter *reporter, const struct state_table *table,
+                           unsigned long records) {
+    pthread_mutex_lock(&reporter->lock);
+    size_t max_states = (size_t)reporter->max_states;
+    struct climate_info *states = reserve_array(reporter->states, &max_states,
+                                                (size_t)table->num_states, sizeof(*states));
+    if (states == NULL) {
+        pthread_mutex_unlock(&reporter->lock);
+        return;  // This snapshot is skipped
+    }
+    reporter->states = states;
+    reporter->max_states = (int)max_states;
+    for (int i = 0; i < table->num_states; i++) {
+        reporter->states[i] = *table->states[i];
+    }
+    reporter->num_states = table->num_states;
+    reporter->records = records;
+    reporter->pending = 1;
+    pthread_cond_signal(&reporter->wake);
+    pthread_mutex_unlock(&reporter->lock);
+}
+
+/*
+ * Publishes a rolling report of the stream so far, after the pending column
+ * batches are folded in, and moves the next count and time due past it.
+ * Returns 0, or -1 if the columns could not be flushed.
+ */
+static int report_now(struct reporter *reporter, struct state_table *table, struct columnar_buffer *columns,
+                      unsigned long records, unsigned long *next_report, struct timespec *last_report) {
+    if (columns != NULL && flush_columns(table, columns) != 0) {
+        return -1;
+    }
+    publish_report(reporter, table, records);
+    *next_report = options.report_every > 0 ? records + options.report_every : 0;
+    clock_gettime(CLOCK_MONOTONIC, last_report);
+    return 0;
+}
+
+// Lets the report thread print what is pending, then waits for it to exit
+static void stop_reporter(struct reporter *reporter) {
+    pthread_mutex_lock(&reporter->lock);
+    reporter->done = 1;
+    pthread_cond_signal(&reporter->wake);
+    pthread_mutex_unlock(&reporter->lock);
+    pthread_join(reporter->thread, NULL);
+    pthread_cond_destroy(&reporter->wake);
+    pthread_mutex_destroy(&reporter->lock);
+    free(reporter->states);
+}
+
+// Maps a whole regular file read-only; NULL for pipes, empty files and mmap failures
+static void *map_file(FILE *file, size_t *size) {
+    struct stat st;
+    if (ftello(file) != 0 || fstat(fileno(file), &st) != 0 ||
+        !S_ISREG(st.st_mode) || st.st_size <= 0 || (unsigned long long)st.st_size > SIZE_MAX) {
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+    void *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    posix_madvise(data, *size, POSIX_MADV_SEQUENTIAL);
+    return data;
+}
+
+/*
+ * A slice of one input and the private table it is folded into: either a
+ * newline-aligned byte range of a mapped text file, the lines at some of
+ * the offsets an index found in one, or a run of whole blocks of a binary
+ * cache.
+ */
+struct chunk_job {
+    long (*scan)(struct chunk_job *job);
+    const char *data;
+    size_t size;
+    const uint64_t *offsets;
+    size_t num_offsets;
+    const struct cache_map *cache;
+    size_t first_block;
+    size_t num_blocks;
+    struct state_table table;
+    long lines_processed;
+};
+
+static void chunk_task(void *arg) {
+    struct chunk_job *job = arg;
+    job->lines_processed = job->scan(job);
+}
+
+static long scan_text_chunk(struct chunk_job *job) {
+    return scan_buffer(job->data, job->size, &job->table);
+}
+
+static long scan_index_chunk(struct chunk_job *job) {
+    return scan_lines(job->data, job->size, job->offsets, job->num_offsets, &job->table);
+}
+
+static long scan_cache_chunk(struct chunk_job *job) {
+    return scan_cache(job->cache, job->first_block, job->num_blocks, &job->table);
+}
+
+/*
+ * Runs the chunks as tasks of the pool and merges their tables into table in
+ * order. Returns the number of records merged, or -1 on error.
+ */
+static long run_chunks(struct chunk_job *jobs, size_t n, struct state_table *table) {
+    struct task_group group = { 0 };
+    for (size_t i = 0; i < n; i++) {
+        submit_task(&group, chunk_task, &jobs[i]);
+    }
+    wait_group(&group);
+
+    long result = 0;
+    for (size_t i = 0; i < n && result >= 0; i++) {
+        if (jobs[i].lines_processed < 0) {
+            result = -1;
+        }
+    }
+    for (size_t i = 0; i < n && result >= 0; i++) {
+        long merged = merge_states(table, &jobs[i].table);
+        result = merged < 0 ? -1 : result + merged;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        free_states(&jobs[i].table);
+    }
+    return result;
+}
+
+/*
+ * Number of chunks an input of the given size is worth splitting into: a few
+ * per worker, so the workers that finish early steal the rest.
+ */
+static size_t chunk_count(size_t size) {
+    if (pool.num_workers < 2) {
+        return 1;
+    }
+    size_t num_chunks = size / MIN_CHUNK_SIZE;
+    size_t most = (size_t)pool.num_workers * CHUNKS_PER_WORKER;
+    return num_chunks < most ? num_chunks : most;
+}
+
+/*
+ * Analyzes an in-memory TDV file. Large buffers are cut into newline-aligned
+ * ranges, each range is scanned by a task of the pool into a private table, and
+ * the tables are merged back in file order, so the result is the same as a
+ * single pass over the whole buffer.
+ */
+int analyze_buffer(const char *data, size_t size, struct state_table *table) {
+    if (data == NULL || table == NULL) {
+        return -1;  // Invalid parameters
+    }
+
+    long lines_processed = analyze_range(data, size, table);
+    return (lines_processed > 0) ? 0 : -1;  // Return success if any lines were processed
+}
+
+// analyze_buffer without the final verdict: returns the lines used, or -1 on error
+static long analyze_range(const char *data, size_t size, struct state_table *table) {
+    size_t num_chunks = chunk_count(size);
+    if (num_chunks < 2) {
+        return scan_buffer(data, size, table);
+    }
+
+    struct chunk_job *jobs = calloc(num_chunks, sizeof(struct chunk_job));
+    if (jobs == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+
+    // Cut the buffer right after a newline near every 1/n-th of it
+    const char *end = data + size;
+    const char *begin = data;
+    size_t n = 0;
+    for (size_t i = 0; i < num_chunks && begin < end; i++) {
+        const char *stop = end;
+        if (i + 1 < num_chunks) {
+            const char *target = data + size / num_chunks * (i + 1);
+            if (target < begin) target = begin;
+            const char *newline = memchr(target, '\n', (size_t)(end - target));
+            stop = newline != NULL ? newline + 1 : end;
+        }
+        jobs[n].scan = scan_text_chunk;
+        jobs[n].data = begin;
+        jobs[n].size = (size_t)(stop - begin);
+        n++;
+        begin = stop;
+    }
+
+    long result = run_chunks(jobs, n, table);
+    free(jobs);
+    return result;
+}
+
+/*
+ * Sampling (--sample P). A mapped text file is cut into SAMPLE_BLOCK byte
+ * blocks, a cache into its own blocks, and each block is picked with
+ * probability P by a hash of its number and the input's size, so a run picks
+ * the same blocks whatever the thread count. A line belongs to the block it
+ * starts in. Only the picked blocks are read, as chunk tasks like the ranges
+ * of analyze_buffer, and after each of them fold_sample notes per state what
+ * the block added to its counts.
+ *
+ * Bytes are known for the whole file, and a state's records per byte vary
+ * far less between blocks than its records per block, so each count is
+ * estimated by ratio: with y a block's count and x its bytes, summed over
+ * the picked blocks, the file's total is y / x times the file's bytes X.
+ * Its variance is taken as (1 - P) / P^2 times the sum of (y - x R)^2 over
+ * the picked blocks, R = y / x, and n / (n - 1) for the n blocks R was
+ * fitted to. finish_sample turns this into what the blocks left out add and
+ * its variance, per file, and those add up across files like the other
+ * aggregates. Averages and extremes are the sample's own. Inputs that cannot
+ * be sampled (standard input, compressed files, index lookups) and those
+ * expected to yield fewer than SAMPLE_MIN_BLOCKS blocks are read in full,
+ * and their counts are exact.
+ */
+
+// Whether block number block of an input of the given size is in the sample (splitmix64)
+static int sample_picked(uint64_t block, uint64_t size) {
+    uint64_t z = (size ^ SAMPLE_SEED) + (block + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return (double)(z >> 11) / 9007199254740992.0 < options.sample;
+}
+
+/*
+ * Brings the samples of table up to its counts. What the states gained since
+ * the last fold is the share of one block of the given bytes; with bytes 0
+ * the gains are only marked as seen. Returns 0 on success.
+ */
+static int fold_sample(struct state_table *table, uint64_t bytes) {
+    for (int i = 0; i < table->num_states; i++) {
+        const struct climate_info *info = table->states[i];
+        struct sample_counts *sample = table->samples[i];
+        if (sample == NULL && (sample = table->samples[i] =
+                               arena_alloc(&table->arena, sizeof(struct sample_counts))) == NULL) {
+            return -1;
+        }
+        uint64_t now[NUM_SAMPLE_COUNTS] = { info->num_records, lightning_count(info), snow_count(info) };
+        for (int k = 0; k < NUM_SAMPLE_COUNTS; k++) {
+            uint64_t share = bytes > 0 ? now[k] - sample->marks[k] : 0;
+            sample->counts[k] += share;
+            sample->squares[k] += share * share;
+            sample->cross[k] += share * bytes;
+            sample->marks[k] = now[k];
+        }
+    }
+    return 0;
+}
+
+/*
+ * Turns the block sums of table's samples into the estimates for the blocks
+ * left out of a file of total bytes, whose num_picked picked blocks had
+ * bytes and sum_squares (the sum of their bytes squared) in all.
+ */
+static void finish_sample(struct state_table *table, size_t num_picked, double bytes,
+                          double sum_squares, double total) {
+    double p = options.sample;
+    double scale = (1 - p) / (p * p);
+    if (num_picked > 1) {
+        scale *= (double)num_picked / (double)(num_picked - 1);  // R was fitted to the same blocks
+    }
+    for (int i = 0; i < table->num_states; i++) {
+        struct sample_counts *sample = table->samples[i];
+        for (int k = 0; sample != NULL && k < NUM_SAMPLE_COUNTS; k++) {
+            double ratio = bytes > 0 ? (double)sample->counts[k] / bytes : 0;
+            double residual = (double)sample->squares[k] - 2 * ratio * (double)sample->cross[k] +
+                              ratio * ratio * sum_squares;
+            sample->unread[k] += ratio * total - (double)sample->counts[k];
+            sample->variance[k] += scale * (residual > 0 ? residual : 0);
+            sample->counts[k] = sample->squares[k] = sample->cross[k] = 0;
+        }
+    }
+}
+
+// Adds the sample of src's slot src_slot to dst's slot dst_slot; returns 0 on success
+static int merge_sample(struct state_table *dst, int dst_slot, const struct state_table *src,
+                        int src_slot) {
+    const struct sample_counts *from = src->samples[src_slot];
+    if (from == NULL) {
+        return 0;
+    }
+    struct sample_counts *sample = dst->samples[dst_slot];
+    if (sample == NULL && (sample = dst->samples[dst_slot] =
+                           arena_alloc(&dst->arena, sizeof(struct sample_counts))) == NULL) {
+        return -1;
+    }
+    for (int k = 0; k < NUM_SAMPLE_COUNTS; k++) {
+        sample->unread[k] += from->unread[k];
+        sample->variance[k] += from->variance[k];
+        sample->counts[k] += from->counts[k];
+        sample->squares[k] += from->squares[k];
+        sample->cross[k] += from->cross[k];
+    }
+    return 0;
+}
+
+// Bytes of a picked block: a text byte range, or cache blocks begin up to end
+static uint64_t sample_bytes(const struct cache_map *cache, uint64_t begin, uint64_t end) {
+    return cache != NULL ? (uint64_t)(cache->blocks[end] - cache->blocks[begin]) : end - begin;
+}
+
+/*
+ * Scans the picked blocks of a chunk, given as [begin, end) pairs in
+ * offsets: byte offsets into data, or block numbers of cache.
+ */
+static long scan_sample_chunk(struct chunk_job *job) {
+    long lines_processed = 0;
+    if (fold_sample(&job->table, 0) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < job->num_offsets; i++) {
+        uint64_t begin = job->offsets[2 * i];
+        uint64_t end = job->offsets[2 * i + 1];
+        long result = job->cache != NULL
+                    ? scan_cache(job->cache, (size_t)begin, (size_t)(end - begin), &job->table)
+                    : scan_buffer(job->data + begin, (size_t)(end - begin), &job->table);
+        if (result < 0 || fold_sample(&job->table, sample_bytes(job->cache, begin, end)) != 0) {
+            return -1;
+        }
+        lines_processed += result;
+    }
+    return lines_processed;
+}
+
+/*
+ * Scans the num_picked blocks in bounds (see scan_sample_chunk) of an input
+ * of total bytes as chunk tasks, and merges them with their estimates into
+ * table. Returns the number of records merged, or -1 on error.
+ */
+static long run_sampled(const char *data, const struct cache_map *cache, const uint64_t *bounds,
+                        size_t num_picked, uint64_t total, struct state_table *table) {
+    double bytes = 0;
+    double sum_squares = 0;
+    for (size_t i = 0; i < num_picked; i++) {
+        double x = (double)sample_bytes(cache, bounds[2 * i], bounds[2 * i + 1]);
+        bytes += x;
+        sum_squares += x * x;
+    }
+    size_t num_chunks = chunk_count((size_t)bytes);
+    if (num_chunks > num_picked) num_chunks = num_picked;
+    if (num_chunks < 1) num_chunks = 1;
+
+    struct chunk_job *jobs = calloc(num_chunks, sizeof(struct chunk_job));
+    if (jobs == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    for (size_t i = 0; i < num_chunks; i++) {
+        size_t first = num_picked * i / num_chunks;
+        jobs[i].scan = scan_sample_chunk;
+        jobs[i].data = data;
+        jobs[i].cache = cache;
+        jobs[i].offsets = bounds + 2 * first;
+        jobs[i].num_offsets = num_picked * (i + 1) / num_chunks - first;
+    }
+
+    // The estimates are per file, so the file's blocks are gathered apart from table
+    struct state_table part;
+    memset(&part, 0, sizeof(part));
+    long result = run_chunks(jobs, num_chunks, &part);
+    free(jobs);
+    if (result >= 0) {
+        finish_sample(&part, num_picked, bytes, sum_squares, (double)total);
+        result = merge_states(table, &part);
+    }
+    free_states(&part);
+    return result;
+}
+
+/*
+ * analyze_range for --sample: scans the picked blocks of a mapped text file,
+ * or all of it if it is too small to be sampled. Returns the number of lines
+ * used, or -1 on error.
+ */
+static long analyze_sampled(const char *data, size_t size, struct state_table *table) {
+    size_t num_blocks = (size + SAMPLE_BLOCK - 1) / SAMPLE_BLOCK;
+    if ((double)num_blocks * options.sample < SAMPLE_MIN_BLOCKS) {
+        return analyze_range(data, size, table);
+    }
+
+    size_t num_picked = 0;
+    for (size_t b = 0; b < num_blocks; b++) {
+        num_picked += sample_picked(b, size);
+    }
+    uint64_t *bounds = malloc(2 * (num_picked ? num_picked : 1) * sizeof(uint64_t));
+    if (bounds == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+
+    // Only the picked blocks are touched, so have the kernel read just those
+    posix_madvise((void *)data, size, POSIX_MADV_RANDOM);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t n = 0;
+    for (size_t b = 0; b < num_blocks; b++) {
+        if (!sample_picked(b, size)) {
+            continue;
+        }
+        // The lines that start in the block: each edge moves to just after a newline
+        size_t edges[2];
+        for (int e = 0; e < 2; e++) {
+            size_t at = (b + (size_t)e) * SAMPLE_BLOCK;
+            const char *newline = at == 0 || at >= size ? NULL : memchr(data + at - 1, '\n', size - (at - 1));
+            edges[e] = at == 0 ? 0 : newline != NULL ? (size_t)(newline - data) + 1 : size;
+        }
+        if (edges[0] >= edges[1]) {
+            continue;  // Inside a line that started in an earlier block
+        }
+        size_t start = edges[0] / page * page;
+        posix_madvise((void *)(data + start), edges[1] - start, POSIX_MADV_WILLNEED);
+        bounds[2 * n] = edges[0];
+        bounds[2 * n + 1] = edges[1];
+        n++;
+    }
+
+    long result = run_sampled(data, NULL, bounds, n, size, table);
+    free(bounds);
+    return result;
+}
+
+/*
+ * Compressed input. A mapped file that starts with the gzip or zstd magic
+ * is decompressed by gzip -dc or zstd -dc in child processes, so
+ * decompression runs as its own pipeline stage next to parsing. Files made
+ * of independently decodable pieces -- BGZF gzip members, which record their
+ * size, or zstd frames, whose block headers can be walked -- are split at
+ * piece boundaries into one part per chunk task. Each part gets its own
+ * decompressor and private table, like the chunks of analyze_buffer. A part
+ * cannot know where its first line starts, so it hands the bytes up to its
+ * first newline (and after its last one) back, and those lines are parsed
+ * where the parts meet.
+ */
+
+/*
+ * The bytes of a part before its first newline and after its last one, which
+ * belong to lines shared with the neighbouring parts. has_newline is 0 when
+ * the whole part ended up in head.
+ */
+struct stream_edges {
+    int keep_head;
+    int keep_tail;
+    char *head;
+    size_t head_len;
+    char *tail;
+    size_t tail_len;
+    int has_newline;
+};
+
+// One run of whole members or frames of a compressed file
+struct compressed_job {
+    const char *data;
+    size_t size;
+    int kind;
+    struct state_table *table;
+    struct stream_edges edges;
+    long lines_processed;
+};
+
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int compression_of(const char *data, size_t size) {
+    const unsigned char *p = (const unsigned char *)data;
+    if (size >= 2 && p[0] == 0x1f && p[1] == 0x8b) {
+        return COMPRESSION_GZIP;
+    }
+    if (size >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+// Size of the BGZF member at p (a gzip member with its size in a BC extra field), or 0
+static size_t bgzf_member_size(const unsigned char *p, size_t avail) {
+    if (avail < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4)) {
+        return 0;
+    }
+    size_t xlen = (size_t)p[10] | (size_t)p[11] << 8;
+    for (size_t i = 12; i + 4 <= 12 + xlen && i + 4 <= avail; ) {
+        size_t slen = (size_t)p[i + 2] | (size_t)p[i + 3] << 8;
+        if (p[i] == 'B' && p[i + 1] == 'C' && slen == 2 && i + 6 <= avail) {
+            size_t size = ((size_t)p[i + 4] | (size_t)p[i + 5] << 8) + 1;
+            return size <= avail ? size : 0;
+        }
+        i += 4 + slen;
+    }
+    return 0;
+}
+
+// Size of the zstd (or skippable) frame at p, found by walking its block headers; 0 if malformed
+static size_t zstd_frame_size(const unsigned char *p, size_t avail) {
+    static const size_t dict_id_size[4] = { 0, 1, 2, 4 };
+    static const size_t content_size[4] = { 0, 2, 4, 8 };
+    if (avail < 8) {
+        return 0;
+    }
+    uint32_t magic = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+    if ((magic & 0xFFFFFFF0u) == 0x184D2A50u) {
+        size_t size = 8 + ((size_t)p[4] | (size_t)p[5] << 8 | (size_t)p[6] << 16 | (size_t)p[7] << 24);
+        return size <= avail ? size : 0;
+    }
+    if (magic != 0xFD2FB528u) {
+        return 0;
+    }
+
+    unsigned descriptor = p[4];
+    unsigned single_segment = descriptor >> 5 & 1;
+    unsigned content_flag = descriptor >> 6;
+    size_t pos = 5 + !single_segment + dict_id_size[descriptor & 3] +
+                 (content_flag == 0 ? single_segment : content_size[content_flag]);
+    for (;;) {
+        if (pos + 3 > avail) {
+            return 0;
+        }
+        uint32_t header = (uint32_t)p[pos] | (uint32_t)p[pos + 1] << 8 | (uint32_t)p[pos + 2] << 16;
+        unsigned type = header >> 1 & 3;
+        if (type == 3) {
+            return 0;  // Reserved block type
+        }
+        pos += 3 + (type == 1 ? 1 : header >> 3);  // RLE blocks store one byte
+        if (header & 1) {
+            break;  // Last block
+        }
+    }
+    pos += (descriptor >> 2 & 1) ? 4 : 0;  // Content checksum
+    return pos <= avail ? pos : 0;
+}
+
+/*
+ * Cuts data into at most max_parts runs of whole members or frames of about
+ * equal size; bounds[0..parts] receives the boundaries. Returns the number of
+ * parts, 1 when the input is not made of pieces this can find.
+ */
+static size_t split_compressed(const char *data, size_t size, int kind, size_t max_parts,
+                               size_t *bounds) {
+    const unsigned char *p = (const unsigned char *)data;
+    size_t parts = 1;
+    bounds[0] = 0;
+    for (size_t pos = 0; pos < size && max_parts > 1; ) {
+        size_t piece = kind == COMPRESSION_GZIP ? bgzf_member_size(p + pos, size - pos)
+                                                : zstd_frame_size(p + pos, size - pos);
+        if (piece == 0) {
+            parts = 1;
+            break;
+        }
+        pos += piece;
+        if (pos < size && parts < max_parts && pos >= size / max_parts * parts) {
+            bounds[parts++] = pos;
+        }
+    }
+    bounds[parts] = size;
+    return parts;
+}
+
+/*
+ * Starts the decompressor for one part: a feeder process writes the bytes
+ * into a pipe that is the standard input of gzip -dc or zstd -dc. Returns
+ * the read end of the decompressor's output, or -1. Spawning is serialized
+ * so no child inherits another part's pipes between pipe() and FD_CLOEXEC.
+ */
+static int start_decompressor(const char *data, size_t size, int kind, pid_t pids[2]) {
+    int in[2], out[2];
+    pthread_mutex_lock(&spawn_lock);
+    if (pipe(in) != 0) {
+        pthread_mutex_unlock(&spawn_lock);
+        return -1;
+    }
+    if (pipe(out) != 0) {
+        close(in[0]);
+        close(in[1]);
+        pthread_mutex_unlock(&spawn_lock);
+        return -1;
+    }
+    fcntl(in[0], F_SETFD, FD_CLOEXEC);
+    fcntl(in[1], F_SETFD, FD_CLOEXEC);
+    fcntl(out[0], F_SETFD, FD_CLOEXEC);
+    fcntl(out[1], F_SETFD, FD_CLOEXEC);
+
+    pids[0] = fork();
+    if (pids[0] == 0) {
+        // Feeder: only async-signal-safe calls in a child of a threaded process.
+        // It never execs, so it drops the other pipe ends itself: holding
+        // out[1] would keep the reader from seeing EOF, and in[0] would keep
+        // this write from failing once the decompressor is gone
+        close(in[0]);
+        close(out[0]);
+        close(out[1]);
+        while (size > 0) {
+            ssize_t n = write(in[1], data, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) _exit(1);
+            data += n;
+            size -= (size_t)n;
+        }
+        _exit(0);
+    }
+    pids[1] = pids[0] < 0 ? -1 : fork();
+    if (pids[1] == 0) {
+        close(in[1]);
+        close(out[0]);
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        if (kind == COMPRESSION_GZIP) {
+            execlp("gzip", "gzip", "-dc", (char *)NULL);
+        } else {
+            execlp("zstd", "zstd", "-dcq", (char *)NULL);
+        }
+        _exit(127);
+    }
+    close(in[0]);
+    close(in[1]);
+    close(out[1]);
+    pthread_mutex_unlock(&spawn_lock);
+
+    if (pids[1] < 0) {
+        close(out[0]);
+        if (pids[0] > 0) {
+            waitpid(pids[0], NULL, 0);
+        }
+        return -1;
+    }
+    return out[0];
+}
+
+/*
+ * Scans the TDV text read from fd in STREAM_BUFFER blocks. Only whole lines
+ * are scanned; the unfinished line at the end of a block is moved to the
+ * front for the next read. With edges, the bytes up to the first newline
+ * (keep_head) and after the last one (keep_tail) are handed back instead of
+ * scanned. Returns the number of lines used, or -1 on error.
+ */
+static long scan_stream(int fd, struct state_table *table, struct stream_edges *edges) {
+    size_t capacity = STREAM_BUFFER;
+    size_t len = 0;
+    char *buffer = malloc(capacity);
+    int want_head = edges != NULL && edges->keep_head;
+    long lines_processed = 0;
+    int failed = 0;
+    if (buffer == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+
+    while (!failed) {
+        if (len == capacity) {
+            // A line longer than the buffer: let it grow
+            char *bigger = realloc(buffer, capacity * 2);
+            if (bigger == NULL) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                failed = 1;
+                break;
+            }
+            buffer = bigger;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, buffer + len, capacity - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            failed = n < 0;
+            break;
+        }
+        size_t seen = len;
+        len += (size_t)n;
+
+        if (want_head) {
+            const char *newline = memchr(buffer + seen, '\n', len - seen);
+            if (newline == NULL) {
+                continue;
+            }
+            size_t head = (size_t)(newline - buffer) + 1;
+            if ((edges->head = malloc(head)) == NULL) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                failed = 1;
+                break;
+            }
+            memcpy(edges->head, buffer, head);
+            edges->head_len = head;
+            edges->has_newline = 1;
+            memmove(buffer, buffer + head, len - head);
+            len -= head;
+            seen = 0;
+            want_head = 0;
+        }
+
+        // The bytes before seen are an unfinished line, so only the new ones can end one
+        size_t complete = len;
+        while (complete > seen && buffer[complete - 1] != '\n') {
+            complete--;
+        }
+        if (complete == seen) {
+            complete = 0;
+        }
+        if (complete > 0) {
+            long result = scan_buffer(buffer, complete, table);
+            if (result < 0) {
+                failed = 1;
+                break;
+            }
+            lines_processed += result;
+            memmove(buffer, buffer + complete, len - complete);
+            len -= complete;
+        }
+    }
+
+    if (!failed && len > 0) {
+        if (want_head || (edges != NULL && edges->keep_tail)) {
+            char **keep = want_head ? &edges->head : &edges->tail;
+            size_t *keep_len = want_head ? &edges->head_len : &edges->tail_len;
+            if ((*keep = malloc(len)) == NULL) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                failed = 1;
+            } else {
+                memcpy(*keep, buffer, len);
+                *keep_len = len;
+            }
+        } else {
+            long result = scan_buffer(buffer, len, table);
+            failed = result < 0;
+            lines_processed += result > 0 ? result : 0;
+        }
+    }
+    free(buffer);
+    return failed ? -1 : lines_processed;
+}
+
+// Decompresses and scans one part into its private table
+static void compressed_task(void *arg) {
+    struct compressed_job *job = arg;
+    pid_t pids[2];
+    job->lines_processed = -1;
+    int fd = start_decompressor(job->data, job->size, job->kind, pids);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Unable to start the decompressor\n");
+        return;
+    }
+    long result = scan_stream(fd, job->table, &job->edges);
+    close(fd);  // A decompressor still writing gets SIGPIPE, the feeder in turn
+
+    int status = 0;
+    waitpid(pids[0], NULL, 0);
+    waitpid(pids[1], &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+            fprintf(stderr, "Error: Unable to run %s\n", job->kind == COMPRESSION_GZIP ? "gzip" : "zstd");
+        }
+        result = -1;
+    }
+    job->lines_processed = result;
+}
+
+// Appends n bytes to a line assembled from the edges of neighbouring parts
+static int append_bytes(char **buffer, size_t *len, const char *bytes, size_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    char *bigger = realloc(*buffer, *len + n);
+    if (bigger == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    memcpy(bigger + *len, bytes, n);
+    *buffer = bigger;
+    *len += n;
+    return 0;
+}
+
+/*
+ * Merges the parts' tables into table in file order. The line that straddles
+ * two parts is the tail of the earlier one plus the head of the later one; a
+ * part without any newline only extends that line. Returns the number of
+ * lines used, or -1 on error.
+ */
+static long merge_parts(struct compressed_job *jobs, size_t parts, struct state_table *table) {
+    char *line = NULL;
+    size_t line_len = 0;
+    long result = 0;
+    for (size_t i = 0; i < parts && result >= 0; i++) {
+        struct stream_edges *edges = &jobs[i].edges;
+        if (append_bytes(&line, &line_len, edges->head, edges->head_len) != 0) {
+            result = -1;
+            break;
+        }
+        if (i > 0 && !edges->has_newline) {
+            continue;
+        }
+        if (line_len > 0) {
+            long used = scan_buffer(line, line_len, table);
+            result = used < 0 ? -1 : result + used;
+            line_len = 0;
+        }
+        long merged = result < 0 ? -1 : merge_states(table, jobs[i].table);
+        result = merged < 0 ? -1 : result + merged;
+        if (result >= 0 && append_bytes(&line, &line_len, edges->tail, edges->tail_len) != 0) {
+            result = -1;
+        }
+    }
+    if (result >= 0 && line_len > 0) {
+        long used = scan_buffer(line, line_len, table);
+        result = used < 0 ? -1 : result + used;
+    }
+    free(line);
+    return result;
+}
+
+/*
+ * Decompresses and scans up to max_parts parts as tasks of the pool. Returns
+ * the number of lines used, or -1 on error.
+ */
+static long analyze_parts(const char *data, size_t size, int kind, size_t max_parts,
+                          struct state_table *table) {
+    size_t bounds[MAX_THREADS + 1];
+    size_t parts = split_compressed(data, size, kind, max_parts, bounds);
+
+    struct compressed_job *jobs = calloc(parts, sizeof(struct compressed_job));
+    struct state_table *tables = parts > 1 ? calloc(parts, sizeof(struct state_table)) : NULL;
+    if (jobs == NULL || (parts > 1 && tables == NULL)) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(jobs);
+        free(tables);
+        return -1;
+    }
+    for (size_t i = 0; i < parts; i++) {
+        jobs[i].data = data + bounds[i];
+        jobs[i].size = bounds[i + 1] - bounds[i];
+        jobs[i].kind = kind;
+        jobs[i].table = parts > 1 ? &tables[i] : table;  // A single part goes straight in
+        jobs[i].edges.keep_head = i > 0;
+        jobs[i].edges.keep_tail = i + 1 < parts;
+    }
+
+    struct task_group group = { 0 };
+    for (size_t i = 0; i < parts; i++) {
+        submit_task(&group, compressed_task, &jobs[i]);
+    }
+    wait_group(&group);
+
+    long result = 0;
+    for (size_t i = 0; i < parts && result >= 0; i++) {
+        if (jobs[i].lines_processed < 0) {
+            result = -1;
+        } else {
+            result += jobs[i].lines_processed;
+        }
+    }
+    if (parts > 1 && result >= 0) {
+        result = merge_parts(jobs, parts, table);
+    }
+
+    for (size_t i = 0; i < parts; i++) {
+        free(jobs[i].edges.head);
+        free(jobs[i].edges.tail);
+        if (parts > 1) {
+            free_states(&tables[i]);
+        }
+    }
+    free(jobs);
+    free(tables);
+    return result;
+}
+
+/*
+ * Analyzes a mapped compressed file (see compression_of). Returns the number
+ * of lines used, or -1 on error.
+ */
+static long analyze_compressed(const char *data, size_t size, int kind, struct state_table *table) {
+    size_t max_parts = chunk_count(size);
+    if (max_parts > MAX_THREADS) max_parts = MAX_THREADS;  // Each part runs two processes
+    return analyze_parts(data, size, kind, max_parts > 1 ? max_parts : 1, table);
+}
+/*
+ * Read-ahead (--prefetch N): instead of mapping a regular file, keep N
+ * PREFETCH_BUFFER sized reads of it in flight and scan each buffer as soon
+ * as it is filled, while the following ones load. On Linux the reads go
+ * through an io_uring; where that cannot be set up, one thread pread()s the
+ * buffers in order. Only the line that straddles two buffers is copied, to
+ * put its halves together.
+ */
+
+// One buffer of the read-ahead ring and the block of the file it holds
+struct prefetch_slot {
+    char *data;
+    uint64_t offset;  // File offset of the block
+    size_t want;      // Bytes of the block (less than the buffer at the end)
+    size_t got;       // Bytes read so far
+    int state;        // SLOT_*
+    struct iovec iov;
+};
+
+enum { SLOT_FREE, SLOT_READING, SLOT_READY, SLOT_FAILED };
+
+struct prefetch {
+    int fd;
+    uint64_t size;
+    int num_slots;
+    struct prefetch_slot slots[PREFETCH_MAX];
+    int uring;  // 1 = io_uring, 0 = reader thread
+
+    // io_uring: the mapped submission and completion rings
+    int ring_fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Reader thread: fills free slots in block order until stop is set
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int stop;
+};
+
+// Slot that holds block number block, and the block's place in the file
+static struct prefetch_slot *prefetch_slot(struct prefetch *pf, uint64_t block) {
+    struct prefetch_slot *slot = &pf->slots[block % (uint64_t)pf->num_slots];
+    slot->offset = block * PREFETCH_BUFFER;
+    slot->want = pf->size - slot->offset < PREFETCH_BUFFER ? (size_t)(pf->size - slot->offset)
+                                                           : PREFETCH_BUFFER;
+    slot->got = 0;
+    return slot;
+}
+
+#ifdef __linux__
+static int uring_setup(struct prefetch *pf) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    long fd = syscall(__NR_io_uring_setup, (unsigned)pf->num_slots, &params);
+    if (fd < 0) {
+        return -1;
+    }
+    pf->ring_fd = (int)fd;
+    pf->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    pf->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (pf->cq_ring_size > pf->sq_ring_size) pf->sq_ring_size = pf->cq_ring_size;
+        pf->cq_ring_size = 0;
+    }
+    pf->sq_ring = mmap(NULL, pf->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, pf->ring_fd,
+                       IORING_OFF_SQ_RING);
+    pf->cq_ring = pf->sq_ring;
+    if (pf->sq_ring != MAP_FAILED && pf->cq_ring_size > 0) {
+        pf->cq_ring = mmap(NULL, pf->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, pf->ring_fd,
+                           IORING_OFF_CQ_RING);
+    }
+    pf->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    pf->sqes = pf->cq_ring == MAP_FAILED ? MAP_FAILED
+             : mmap(NULL, pf->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, pf->ring_fd,
+                    IORING_OFF_SQES);
+    if (pf->sqes == MAP_FAILED) {
+        if (pf->cq_ring != MAP_FAILED && pf->cq_ring_size > 0) munmap(pf->cq_ring, pf->cq_ring_size);
+        if (pf->sq_ring != MAP_FAILED) munmap(pf->sq_ring, pf->sq_ring_size);
+        close(pf->ring_fd);
+        return -1;
+    }
+
+    char *sq = pf->sq_ring, *cq = pf->cq_ring;
+    pf->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    pf->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    pf->sq_array = (unsigned *)(sq + params.sq_off.array);
+    pf->cq_head = (unsigned *)(cq + params.cq_off.head);
+    pf->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    pf->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    pf->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+// Queues a read of the rest of the slot's block; returns 0 on success
+static int uring_submit(struct prefetch *pf, struct prefetch_slot *slot) {
+    unsigned tail = *pf->sq_tail;
+    unsigned index = tail & *pf->sq_mask;
+    struct io_uring_sqe *sqe = &pf->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    slot->iov.iov_base = slot->data + slot->got;
+    slot->iov.iov_len = slot->want - slot->got;
+    sqe->opcode = IORING_OP_READV;  // Plain READ needs Linux 5.6
+    sqe->fd = pf->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&slot->iov;
+    sqe->len = 1;
+    sqe->off = slot->offset + slot->got;
+    sqe->user_data = (uint64_t)(slot - pf->slots);
+    pf->sq_array[index] = index;
+    __atomic_store_n(pf->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    slot->state = SLOT_READING;
+
+    for (;;) {
+        long n = syscall(__NR_io_uring_enter, pf->ring_fd, 1u, 0u, 0u, NULL, (size_t)0);
+        if (n >= 0) return 0;
+        if (errno != EINTR && errno != EAGAIN) return -1;
+    }
+}
+
+// Waits for completions until slot is no longer being read
+static void uring_wait(struct prefetch *pf, struct prefetch_slot *slot) {
+    while (slot->state == SLOT_READING) {
+        unsigned head = *pf->cq_head;
+        if (head == __atomic_load_n(pf->cq_tail, __ATOMIC_ACQUIRE)) {
+            long n = syscall(__NR_io_uring_enter, pf->ring_fd, 0u, 1u, IORING_ENTER_GETEVENTS,
+                             NULL, (size_t)0);
+            if (n < 0 && errno != EINTR) {
+                slot->state = SLOT_FAILED;
+            }
+            continue;
+        }
+        struct io_uring_cqe *cqe = &pf->cqes[head & *pf->cq_mask];
+        struct prefetch_slot *done = &pf->slots[cqe->user_data];
+        int res = cqe->res;
+        __atomic_store_n(pf->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (res == -EINTR || res == -EAGAIN) {
+            res = 0;
+        } else if (res <= 0) {
+            done->state = SLOT_FAILED;  // An error, or the file shrank
+            continue;
+        }
+        done->got += (size_t)res;
+        if (done->got == done->want) {
+            done->state = SLOT_READY;
+        } else if (uring_submit(pf, done) != 0) {
+            done->state = SLOT_FAILED;  // Short read whose rest could not be queued
+        }
+    }
+}
+
+static void uring_close(struct prefetch *pf) {
+    // The kernel may still write into the buffers of reads in flight
+    for (int i = 0; i < pf->num_slots; i++) {
+        uring_wait(pf, &pf->slots[i]);
+    }
+    munmap(pf->sqes, pf->sqes_size);
+    if (pf->cq_ring_size > 0) munmap(pf->cq_ring, pf->cq_ring_size);
+    munmap(pf->sq_ring, pf->sq_ring_size);
+    close(pf->ring_fd);  // Cancels reads still in flight
+}
+#endif
+
+static void *prefetch_worker(void *arg) {
+    struct prefetch *pf = arg;
+    pthread_mutex_lock(&pf->lock);
+    for (uint64_t block = 0; block * PREFETCH_BUFFER < pf->size; block++) {
+        struct prefetch_slot *slot = &pf->slots[block % (uint64_t)pf->num_slots];
+        while (slot->state != SLOT_FREE && !pf->stop) {
+            pthread_cond_wait(&pf->changed, &pf->lock);
+        }
+        if (pf->stop) {
+            break;
+        }
+        prefetch_slot(pf, block);
+        slot->state = SLOT_READING;
+        pthread_mutex_unlock(&pf->lock);
+
+        int failed = 0;
+        while (slot->got < slot->want && !failed) {
+            ssize_t n = pread(pf->fd, slot->data + slot->got, slot->want - slot->got,
+                              (off_t)(slot->offset + slot->got));
+            if (n < 0 && errno == EINTR) continue;
+            failed = n <= 0;
+            slot->got += n > 0 ? (size_t)n : 0;
+        }
+
+        pthread_mutex_lock(&pf->lock);
+        slot->state = failed ? SLOT_FAILED : SLOT_READY;
+        pthread_cond_broadcast(&pf->changed);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+static void close_prefetch(struct prefetch *pf) {
+#ifdef __linux__
+    if (pf->uring) {
+        uring_close(pf);
+    } else
+#endif
+    {
+        pthread_mutex_lock(&pf->lock);
+        pf->stop = 1;
+        pthread_cond_broadcast(&pf->changed);
+        pthread_mutex_unlock(&pf->lock);
+        pthread_join(pf->thread, NULL);
+        pthread_cond_destroy(&pf->changed);
+        pthread_mutex_destroy(&pf->lock);
+    }
+    for (int i = 0; i < pf->num_slots; i++) {
+        free(pf->slots[i].data);
+    }
+}
+
+// Allocates the buffers and starts the first reads; returns 0 on success
+static int open_prefetch(struct prefetch *pf, int fd, uint64_t size) {
+    memset(pf, 0, sizeof(*pf));
+    pf->fd = fd;
+    pf->size = size;
+    uint64_t blocks = (size + PREFETCH_BUFFER - 1) / PREFETCH_BUFFER;
+    pf->num_slots = (uint64_t)options.prefetch < blocks ? options.prefetch : (int)blocks;
+    for (int i = 0; i < pf->num_slots; i++) {
+        if ((pf->slots[i].data = malloc(PREFETCH_BUFFER)) == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            for (int j = 0; j < i; j++) free(pf->slots[j].data);
+            return -1;
+        }
+    }
+
+#ifdef __linux__
+    if (uring_setup(pf) == 0) {
+        pf->uring = 1;
+        for (int i = 0; i < pf->num_slots; i++) {
+            if (uring_submit(pf, prefetch_slot(pf, (uint64_t)i)) != 0) {
+                close_prefetch(pf);
+                return -1;
+            }
+        }
+        return 0;
+    }
+#endif
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->changed, NULL);
+    if (pthread_create(&pf->thread, NULL, prefetch_worker, pf) != 0) {
+        pthread_cond_destroy(&pf->changed);
+        pthread_mutex_destroy(&pf->lock);
+        for (int i = 0; i < pf->num_slots; i++) free(pf->slots[i].data);
+        return -1;
+    }
+    return 0;
+}
+
+// Waits until block is loaded; returns its slot, or NULL if the read failed
+static struct prefetch_slot *wait_block(struct prefetch *pf, uint64_t block) {
+    struct prefetch_slot *slot = &pf->slots[block % (uint64_t)pf->num_slots];
+#ifdef __linux__
+    if (pf->uring) {
+        uring_wait(pf, slot);
+        return slot->state == SLOT_READY ? slot : NULL;
+    }
+#endif
+    pthread_mutex_lock(&pf->lock);
+    while (slot->state == SLOT_FREE || slot->state == SLOT_READING) {
+        pthread_cond_wait(&pf->changed, &pf->lock);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return slot->state == SLOT_READY ? slot : NULL;
+}
+
+// Hands the buffer of a scanned block back for the block num_slots further on
+static int release_block(struct prefetch *pf, uint64_t block) {
+    struct prefetch_slot *slot = &pf->slots[block % (uint64_t)pf->num_slots];
+    uint64_t next = block + (uint64_t)pf->num_slots;
+#ifdef __linux__
+    if (pf->uring) {
+        slot->state = SLOT_FREE;
+        return next * PREFETCH_BUFFER < pf->size ? uring_submit(pf, prefetch_slot(pf, next)) : 0;
+    }
+#endif
+    (void)next;
+    pthread_mutex_lock(&pf->lock);
+    slot->state = SLOT_FREE;
+    pthread_cond_broadcast(&pf->changed);
+    pthread_mutex_unlock(&pf->lock);
+    return 0;
+}
+
+/*
+ * Analyzes a regular file through the read-ahead ring. The complete lines of
+ * each block are scanned in place (split into chunk tasks like a
+ * mapped file); the partial line at its end is kept and completed from the
+ * head of the next block. Returns the number of lines used, -1 on error, or
+ * -2 if the file cannot be read ahead (pipes, empty and compressed files).
+ */
+static long analyze_prefetched(FILE *file, struct state_table *table) {
+    struct stat st;
+    unsigned char magic[4];
+    int fd = fileno(file);
+    if (ftello(file) != 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+        pread(fd, magic, sizeof(magic), 0) < 2 ||
+        compression_of((const char *)magic, st.st_size < 4 ? (size_t)st.st_size : 4) != COMPRESSION_NONE) {
+        return -2;
+    }
+
+    struct prefetch pf;
+    if (open_prefetch(&pf, fd, (uint64_t)st.st_size) != 0) {
+        return -2;  // Fall back to the mapped path
+    }
+
+    char *line = NULL;
+    size_t line_len = 0;
+    long result = 0;
+    struct scan_stats *stats = &table->stats;
+    for (uint64_t block = 0; block * PREFETCH_BUFFER < pf.size && result >= 0; block++) {
+        uint64_t wait_start = stage_clock();
+        struct prefetch_slot *slot = wait_block(&pf, block);
+        stats->ticks[STAGE_READ] += stage_clock() - wait_start;
+        if (slot == NULL) {
+            fprintf(stderr, "Error: Read failed\n");
+            result = -1;
+            break;
+        }
+
+        const char *p = slot->data;
+        const char *end = slot->data + slot->want;
+        if (line_len > 0) {
+            const char *newline = memchr(p, '\n', (size_t)(end - p));
+            const char *stop = newline != NULL ? newline + 1 : end;
+            if (append_bytes(&line, &line_len, p, (size_t)(stop - p)) != 0) {
+                result = -1;
+                break;
+            }
+            p = stop;
+            if (newline != NULL) {
+                long used = scan_buffer(line, line_len, table);
+                result = used < 0 ? -1 : result + used;
+                line_len = 0;
+            }
+        }
+        const char *last = end;
+        while (last > p && last[-1] != '\n') {
+            last--;
+        }
+        if (last > p && result >= 0) {
+            long used = analyze_range(p, (size_t)(last - p), table);
+            result = used < 0 ? -1 : result + used;
+        }
+        if (result >= 0 && append_bytes(&line, &line_len, last, (size_t)(end - last)) != 0) {
+            result = -1;
+        }
+        if (result >= 0 && release_block(&pf, block) != 0) {
+            fprintf(stderr, "Error: Read failed\n");
+            result = -1;
+        }
+    }
+    if (result >= 0 && line_len > 0) {
+        long used = scan_buffer(line, line_len, table);
+        result = used < 0 ? -1 : result + used;
+    }
+    free(line);
+    close_prefetch(&pf);
+    return result;
+}
+
+/*
+ * Cuts the next line (with its newline, if any) off *p. Lines have no length
+ * limit of their own; returns 0 if the line is longer than --max-line and
+ * has to be skipped.
+ */
+static int next_line(const char **p, const char *end, const char **line, size_t *len) {
+    const char *newline = memchr(*p, '\n', (size_t)(end - *p));
+    *line = *p;
+    *len = newline != NULL ? (size_t)(newline - *p) + 1 : (size_t)(end - *p);
+    *p += *len;
+    return options.max_line == 0 || *len - (newline != NULL) <= options.max_line;
+}
+
+/*
+ * Walks an in-memory copy of a TDV file, handing the parser pointer/length
+ * views into the buffer instead of copying each line out. Returns the number
+ * of lines used, or -1 on error.
+ */
+static long scan_buffer(const char *data, size_t size, struct state_table *table) {
+    const char *p = data;
+    const char *end = data + size;
+    long lines_processed = 0;
+
+    struct columnar_buffer *columns = NULL;
+    if (options.columnar && (columns = new_columns()) == NULL) {
+        return -1;
+    }
+
+    struct scan_stats *stats = &table->stats;
+    uint64_t start = stage_clock();
+    uint64_t staged = staged_ticks(stats);
+    stats->bytes += size;
+    while (p < end) {
+        const char *line;
+        size_t len;
+        if (!next_line(&p, end, &line, &len)) {
+            stats->lines++;
+            stats->skipped[SKIP_TOO_LONG]++;
+            continue;
+        }
+
+        int result = process_line(line, len, table, columns);
+        if (result < 0) {
+            free_columns(columns);
+            return -1;
+        }
+        lines_processed += result;
+    }
+
+    if (columns != NULL) {
+        uint64_t flush_start = stage_clock();
+        int failed = flush_columns(table, columns) != 0;
+        stats->ticks[STAGE_AGGREGATE] += stage_clock() - flush_start;
+        free_columns(columns);
+        if (failed) {
+            return -1;
+        }
+    }
+    charge_read(stats, start, staged);
+    return lines_processed;
+}
+
+// Parses and validates one line; returns 0 if it holds a usable record
+static int read_record(const char *line, size_t len, struct tdv_record *rec) {
+    if (parse_record(line, len, rec) != 0) {
+        //fprintf(stderr, "Warning: Skipping malformed line\n");
+        return -1;
+    }
+    return validate_record(rec);
+}
+
+/*
+ * Checks the value ranges of a parsed record; returns 0 if it is usable.
+ * The comparisons are or-ed as bits rather than chained, so there is no
+ * branch per field.
+ */
+static int validate_record(const struct tdv_record *rec) {
+    int bad = (rec->humidity < 0) | (rec->humidity > 100) |
+              (rec->cloudcover < 0) | (rec->cloudcover > 100) |
+              (rec->temperature < 0);  // Kelvin can't be negative
+    return -bad;
+}
+
+/*
+ * Filters (--states, --from, --to). They only need the first two fields, so
+ * filter_fields looks at those before the line is parsed: a rejected line
+ * costs a few byte compares and no float conversion. Lines whose start is
+ * not in the canonical layout are parsed in full and go through
+ * filter_record instead, which gives the same answer.
+ */
+
+static unsigned state_key(char a, char b) {
+    return (unsigned)(unsigned char)a << 8 | (unsigned char)b;
+}
+
+static int state_wanted(unsigned key) {
+    return (options.wanted_states[key / 64] >> (key % 64)) & 1;
+}
+
+// Whether records with this state code pass --states
+static int code_wanted(const char *code) {
+    return !options.filter_states ||
+           (code[0] != '\0' && code[2] == '\0' && state_wanted(state_key(code[0], code[1])));
+}
+
+// Whether a record with this code and timestamp passes the filters
+static int filter_record(const struct tdv_record *rec) {
+    if (!code_wanted(rec->state_code)) {
+        return 0;
+    }
+    return rec->timestamp >= options.from_ms && rec->timestamp < options.to_ms;
+}
+
+// 1 if the line passes the filters, 0 if not, -1 if it has to be parsed to tell
+static int filter_fields(const char *line, size_t len) {
+    if (!options.filter_states && !options.filter_time) {
+        return 1;
+    }
+    const char *p = line;
+    const char *end = line + len;
+    if (len < 4 || is_field_end(p[0]) || is_field_end(p[1]) || p[2] != '\t') {
+        return -1;
+    }
+    if (options.filter_states && !state_wanted(state_key(p[0], p[1]))) {
+        return 0;
+    }
+    if (!options.filter_time) {
+        return 1;
+    }
+
+    unsigned long long timestamp = 0;
+    int digits = 0;
+    for (p += 3; p < end && is_digit(*p); p++) {
+        if (++digits > 19) return -1;
+        timestamp = timestamp * 10 + (unsigned long long)(*p - '0');
+    }
+    if (digits == 0 || p == end || *p != '\t') {
+        return -1;
+    }
+    return timestamp >= options.from_ms && timestamp < options.to_ms;
+}
+
+/*
+ * Reads a --from/--to time: seconds since 1970, or a UTC date YYYY-MM-DD
+ * with an optional THH:MM[:SS]. Returns 0 on success.
+ */
+static int parse_time(const char *text, unsigned long long *ms) {
+    if (strchr(text, '-') == NULL) {
+        char *end;
+        unsigned long long seconds = strtoull(text, &end, 10);
+        if (end == text || *end != '\0' || seconds > ULLONG_MAX / 1000) return -1;
+        *ms = seconds * 1000;
+        return 0;
+    }
+
+    // year, month, day, then optionally hour and minute, and second
+    int fields[6] = { 0 };
+    static const char separators[] = "--T::";
+    const char *p = text;
+    int last = 0;
+    for (;; last++) {
+        int width = last == 0 ? 4 : 2;
+        for (int digits = 0; digits < width; digits++, p++) {
+            if (*p < '0' || *p > '9') return -1;
+            fields[last] = fields[last] * 10 + (*p - '0');
+        }
+        if (*p == '\0') break;
+        if (last == 5 || *p != separators[last]) return -1;
+        p++;
+    }
+    if (last < 2 || last == 3 || fields[0] < 1970 || fields[1] < 1 || fields[1] > 12 ||
+        fields[2] < 1 || fields[2] > 31 || fields[3] > 23 || fields[4] > 59 || fields[5] > 60) {
+        return -1;
+    }
+    int64_t days = days_from_civil(fields[0], fields[1], fields[2]);
+    *ms = (unsigned long long)(((days * 24 + fields[3]) * 60 + fields[4]) * 60 + fields[5]) * 1000;
+    return 0;
+}
+
+/*
+ * Parses, validates and folds one line (or queues it into columns in columnar
+ * mode); returns 1 if used, 0 if skipped, -1 on error.
+ *
+ * Rows out of range are not branched off: they are folded like good ones,
+ * but into the table's discard node, and the counters add the validity
+ * flag, so on feeds that mix good and bad rows there is nothing to
+ * mispredict. Only rows that cannot be parsed (and filtered ones) leave
+ * early. The optional rollups (cells, series, sketches) are only done for
+ * good rows.
+ */
+static int process_line(const char *line, size_t len, struct state_table *table,
+                        struct columnar_buffer *columns) {
+    struct scan_stats *stats = &table->stats;
+    struct tdv_record rec;
+    stats->lines++;
+    uint64_t start = stage_clock();
+    int wanted = filter_fields(line, len);
+    if (wanted == 0) {
+        stats->skipped[SKIP_FILTERED]++;
+        stats->ticks[STAGE_PARSE] += stage_clock() - start;
+        return 0;
+    }
+    if (parse_record(line, len, &rec) != 0) {
+        //fprintf(stderr, "Warning: Skipping malformed line\n");
+        stats->skipped[SKIP_MALFORMED]++;
+        stats->ticks[STAGE_PARSE] += stage_clock() - start;
+        return 0;
+    }
+    uint64_t parsed = stage_clock();
+    stats->ticks[STAGE_PARSE] += parsed - start;
+    if (wanted < 0 && !filter_record(&rec)) {
+        stats->skipped[SKIP_FILTERED]++;
+        return 0;
+    }
+    int valid = validate_record(&rec) == 0;
+    uint64_t validated = stage_clock();
+    stats->ticks[STAGE_VALIDATE] += validated - parsed;
+
+    // Find the state entry; only a good row may create one (rare: its first record)
+    int state_idx = seen_state(table, rec.state_code);
+    if (state_idx < 0 && valid) {
+        state_idx = find_state(table, rec.state_code);
+        if (state_idx < 0) {
+            return -1;
+        }
+    }
+    // A bad row of a code not seen yet must not index table->states, which may still be NULL
+    struct climate_info *found = state_idx < 0 ? &table->discard : table->states[state_idx];
+    struct climate_info *info = valid ? found : &table->discard;  // Both sides loaded, so a select
+    uint64_t looked_up = stage_clock();
+    stats->ticks[STAGE_LOOKUP] += looked_up - validated;
+
+    stats->skipped[SKIP_OUT_OF_RANGE] += !valid;
+    if (columns == NULL) {
+        update_state(info, rec.temperature, rec.humidity, rec.cloudcover,
+                     rec.lightning > 0, rec.snow > 0, rec.timestamp);
+        if (options.metrics) {
+            update_metrics(info, rec.temperature, rec.humidity, rec.pressure);
+        }
+    } else if (valid && append_columns(table, columns, state_idx, &rec) != 0) {
+        return -1;
+    }
+    if (!(valid && (options.buckets | options.quantiles | options.geohash))) {
+        stats->ticks[STAGE_AGGREGATE] += stage_clock() - looked_up;
+        stats->used += (uint64_t)valid;
+        return valid;
+    }
+    if (options.buckets &&
+        add_to_series(&table->series, state_idx, rec.temperature, rec.humidity, rec.cloudcover,
+                      rec.lightning > 0, rec.snow > 0, rec.timestamp) != 0) {
+        return -1;
+    }
+    if (options.quantiles && add_to_sketch(table, state_idx, rec.temperature, rec.humidity) != 0) {
+        return -1;
+    }
+    uint64_t key = options.geohash ? geo_key(rec.geohash) : 0;
+    if (key != 0) {
+        struct climate_info *cell = find_cell(&table->geo, &table->arena, key);
+        if (cell == NULL) {
+            return -1;
+        }
+        update_state(cell, rec.temperature, rec.humidity, rec.cloudcover,
+                     rec.lightning > 0, rec.snow > 0, rec.timestamp);
+    }
+    stats->ticks[STAGE_AGGREGATE] += stage_clock() - looked_up;
+    stats->used++;
+    return 1;
+}
+
+// Folds one accepted record into its state
+static void update_state(struct climate_info *info, double temperature, double humidity,
+                         double cloudcover, int lightning, int snow,
+                         unsigned long long timestamp) {
+    info->num_records++;
+    neumaier_add(&info->sum_temperature, &info->temperature_error, temperature);
+    neumaier_add(&info->sum_humidity, &info->humidity_error, humidity);
+    neumaier_add(&info->sum_cloudcover, &info->cloudcover_error, cloudcover);
+    add_count(&info->lightning_strikes, &info->lightning_high, (uint64_t)lightning);
+    add_count(&info->snow_records, &info->snow_high, (uint64_t)snow);
+
+    // One test for both extremes: after the first records a new one is rare, so
+    // this branch is well predicted, and the cold time fields are only written then
+    int hotter = temperature > info->max_temp;
+    int colder = temperature < info->min_temp;
+    if (hotter | colder) {
+        time_t t = (time_t)(timestamp / 1000);
+        info->max_temp = hotter ? temperature : info->max_temp;
+        info->max_temp_time = hotter ? t : info->max_temp_time;
+        info->min_temp = colder ? temperature : info->min_temp;
+        info->min_temp_time = colder ? t : info->min_temp_time;
+    }
+}
+
+/*
+ * Adds n to a counter kept as a 32-bit low word in the hot part of
+ * climate_info and a carry word in the cold part, which is only touched
+ * when the low word wraps.
+ */
+static void add_count(uint32_t *low, uint32_t *high, uint64_t n) {
+    uint32_t before = *low;
+    *low = before + (uint32_t)n;
+    uint32_t carry = (uint32_t)(n >> 32) + (*low < before);
+    if (carry != 0) {
+        *high += carry;
+    }
+}
+
+unsigned long lightning_count(const struct climate_info *info) {
+    return (unsigned long)((uint64_t)info->lightning_high << 32 | info->lightning_strikes);
+}
+
+unsigned long snow_count(const struct climate_info *info) {
+    return (unsigned long)((uint64_t)info->snow_high << 32 | info->snow_records);
+}
+
+// The compensated sums, with the compensation added in
+long double temperature_total(const struct climate_info *info) {
+    return (long double)info->sum_temperature + info->temperature_error;
+}
+
+long double humidity_total(const struct climate_info *info) {
+    return (long double)info->sum_humidity + info->humidity_error;
+}
+
+long double cloudcover_total(const struct climate_info *info) {
+    return (long double)info->sum_cloudcover + info->cloudcover_error;
+}
+
+/*
+ * Derived metrics (--metrics). Dew point and heat index are computed per
+ * record from its temperature and humidity, with nothing but arithmetic,
+ * bit moves and selects, so the loops of reduce_metrics vectorize (and the
+ * build needs no libm). The row and column paths share these formulas.
+ */
+
+// ln x for a positive normal x, to about 1e-15: x = m 2^e with m in [sqrt(1/2), sqrt(2)), then the atanh series
+static inline double metric_log(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    uint64_t biased = (bits + (0x3FF0000000000000ULL - 0x3FE6A09E667F3BCDULL)) >> 52;
+    bits -= (biased - 1023) << 52;
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+    double s = (m - 1.0) / (m + 1.0);
+    double s2 = s * s;
+    double series = 1.0 + s2 * (1.0 / 3 + s2 * (1.0 / 5 + s2 * (1.0 / 7 + s2 * (1.0 / 9 +
+                    s2 * (1.0 / 11 + s2 * (1.0 / 13 + s2 * (1.0 / 15)))))));
+    return (double)((int)biased - 1023) * 0.6931471805599453 + 2.0 * s * series;
+}
+
+// Square root of y in [0, 1] by Newton steps from (1 + y) / 2, which for y >= 0.1 converge to full precision
+static inline double metric_sqrt(double y) {
+    double x = 0.5 * (1.0 + y);
+    for (int i = 0; i < 5; i++) {
+        x = 0.5 * (x + y / x);
+    }
+    return x;
+}
+
+// Dew point in Kelvin at a humidity above 0 (Magnus formula, Alduchov and Eskridge constants)
+static inline double dew_point(double kelvin, double humidity) {
+    double celsius = kelvin - 273.15;
+    double gamma = metric_log(humidity / 100.0) + 17.625 * celsius / (243.04 + celsius);
+    return 243.04 * gamma / (17.625 - gamma) + 273.15;
+}
+
+/*
+ * Heat index in Kelvin, as the US National Weather Service computes it: the
+ * simple formula, or where that averages with the temperature to 80F or
+ * more, the Rothfusz regression with its adjustments for dry and humid air.
+ */
+static inline double heat_index(double kelvin, double humidity) {
+    double t = (kelvin - 273.15) * 1.8 + 32.0;
+    double rh = humidity;
+    double simple = 0.5 * (t + 61.0 + (t - 68.0) * 1.2 + rh * 0.094);
+    double full = -42.379 + 2.04901523 * t + 10.14333127 * rh - 0.22475541 * t * rh -
+                  0.00683783 * t * t - 0.05481717 * rh * rh + 0.00122874 * t * t * rh +
+                  0.00085282 * t * rh * rh - 0.00000199 * t * t * rh * rh;
+    double spread = 17.0 - fabs(t - 95.0);
+    double dry = (13.0 - rh) * 0.25 * metric_sqrt(spread > 0.0 ? spread / 17.0 : 0.0);
+    double humid = (rh - 85.0) * 0.1 * (87.0 - t) * 0.2;
+    full -= (rh < 13.0 && t >= 80.0 && t <= 112.0) ? dry : 0.0;
+    full += (rh > 85.0 && t >= 80.0 && t <= 87.0) ? humid : 0.0;
+    double f = 0.5 * (simple + t) >= 80.0 ? full : simple;
+    return (f - 32.0) / 1.8 + 273.15;
+}
+
+/*
+ * Folds the selected metrics of one accepted record into its state. A
+ * humidity of 0 has no dew point, so those records are left out of that
+ * average only.
+ */
+static void update_metrics(struct climate_info *info, double temperature, double humidity,
+                           double pressure) {
+    if (options.metrics & METRIC_PRESSURE) {
+        info->sum_pressure += pressure;
+    }
+    if (options.metrics & METRIC_DEW_POINT) {
+        int has_dew_point = humidity > 0.0;
+        double dew = dew_point(temperature, has_dew_point ? humidity : 100.0);
+        info->sum_dew_point += has_dew_point ? dew : 0.0;
+        info->dew_point_records += (unsigned long)has_dew_point;
+    }
+    if (options.metrics & METRIC_HEAT_INDEX) {
+        info->sum_heat_index += heat_index(temperature, humidity);
+    }
+}
+
+/*
+ * Columnar mode (--columnar). Accepted rows are gathered into batches with
+ * one contiguous array per field, and each batch is reduced per state with
+ * SIMD kernels (AVX2 on x86, NEON on ARM, portable C otherwise). Sums use
+ * Neumaier compensation in four fixed lanes, and the portable kernels do the
+ * same per-lane operations in the same order, so the result does not depend
+ * on which kernel ran.
+ */
+
+// One Neumaier step: sum + comp absorbs x; the larger and smaller term are selected, not branched on
+static void neumaier_add(double *sum, double *comp, double x) {
+    double t = *sum + x;
+    int sum_larger = fabs(*sum) >= fabs(x);
+    double larger = sum_larger ? *sum : x;
+    double smaller = sum_larger ? x : *sum;
+    *comp += (larger - t) + smaller;
+    *sum = t;
+}
+
+static void column_sum_scalar(const double *x, size_t n, double sum[4], double comp[4]) {
+    for (size_t i = 0; i < n; i++) {
+        neumaier_add(&sum[i & 3], &comp[i & 3], x[i]);
+    }
+}
+
+static size_t column_count_scalar(const unsigned char *flags, size_t n) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        count += flags[i];
+    }
+    return count;
+}
+
+// Lane-wise search for the largest sign * x[i]; ties keep the earliest index
+static void column_argmax_scalar(const double *x, size_t n, double sign, size_t offset,
+                                 double best[4], size_t index[4]) {
+    for (size_t i = 0; i < n; i++) {
+        size_t lane = i & 3;
+        double v = sign * x[i];
+        if (v > best[lane]) {
+            best[lane] = v;
+            index[lane] = offset + i;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static void column_sum_avx2(const double *x, size_t n, double sum[4], double comp[4]) {
+    const __m256d sign_bit = _mm256_set1_pd(-0.0);
+    __m256d s = _mm256_loadu_pd(sum);
+    __m256d c = _mm256_loadu_pd(comp);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(x + i);
+        __m256d t = _mm256_add_pd(s, v);
+        __m256d bigger = _mm256_cmp_pd(_mm256_andnot_pd(sign_bit, s),
+                                       _mm256_andnot_pd(sign_bit, v), _CMP_GE_OQ);
+        __m256d a = _mm256_add_pd(_mm256_sub_pd(s, t), v);
+        __m256d b = _mm256_add_pd(_mm256_sub_pd(v, t), s);
+        c = _mm256_add_pd(c, _mm256_blendv_pd(b, a, bigger));
+        s = t;
+    }
+    _mm256_storeu_pd(sum, s);
+    _mm256_storeu_pd(comp, c);
+    column_sum_scalar(x + i, n - i, sum, comp);
+}
+
+__attribute__((target("avx2")))
+static size_t column_count_avx2(const unsigned char *flags, size_t n) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i count = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(flags + i));
+        count = _mm256_add_epi64(count, _mm256_sad_epu8(v, zero));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, count);
+    return (size_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]) +
+           column_count_scalar(flags + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void column_argmax_avx2(const double *x, size_t n, double sign,
+                               double best[4], size_t index[4]) {
+    const __m256d flip = _mm256_set1_pd(sign < 0 ? -0.0 : 0.0);
+    const __m256d step = _mm256_set1_pd(4.0);
+    __m256d b = _mm256_loadu_pd(best);
+    __m256d bi = _mm256_set1_pd((double)n);
+    __m256d idx = _mm256_setr_pd(0.0, 1.0, 2.0, 3.0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_xor_pd(_mm256_loadu_pd(x + i), flip);
+        __m256d greater = _mm256_cmp_pd(v, b, _CMP_GT_OQ);
+        b = _mm256_blendv_pd(b, v, greater);
+        bi = _mm256_blendv_pd(bi, idx, greater);
+        idx = _mm256_add_pd(idx, step);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(best, b);
+    _mm256_storeu_pd(lanes, bi);
+    for (int l = 0; l < 4; l++) {
+        index[l] = (size_t)lanes[l];
+    }
+    column_argmax_scalar(x + i, n - i, sign, i, best, index);
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+
+static inline void neumaier_step_neon(float64x2_t *s, float64x2_t *c, float64x2_t v) {
+    float64x2_t t = vaddq_f64(*s, v);
+    uint64x2_t bigger = vcgeq_f64(vabsq_f64(*s), vabsq_f64(v));
+    float64x2_t a = vaddq_f64(vsubq_f64(*s, t), v);
+    float64x2_t b = vaddq_f64(vsubq_f64(v, t), *s);
+    *c = vaddq_f64(*c, vbslq_f64(bigger, a, b));
+    *s = t;
+}
+
+static void column_sum_neon(const double *x, size_t n, double sum[4], double comp[4]) {
+    float64x2_t s0 = vld1q_f64(sum), s1 = vld1q_f64(sum + 2);
+    float64x2_t c0 = vld1q_f64(comp), c1 = vld1q_f64(comp + 2);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        neumaier_step_neon(&s0, &c0, vld1q_f64(x + i));
+        neumaier_step_neon(&s1, &c1, vld1q_f64(x + i + 2));
+    }
+    vst1q_f64(sum, s0);
+    vst1q_f64(sum + 2, s1);
+    vst1q_f64(comp, c0);
+    vst1q_f64(comp + 2, c1);
+    column_sum_scalar(x + i, n - i, sum, comp);
+}
+
+static size_t column_count_neon(const unsigned char *flags, size_t n) {
+    uint64x2_t count = vdupq_n_u64(0);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        count = vpadalq_u32(count, vpaddlq_u16(vpaddlq_u8(vld1q_u8(flags + i))));
+    }
+    return (size_t)(vgetq_lane_u64(count, 0) + vgetq_lane_u64(count, 1)) +
+           column_count_scalar(flags + i, n - i);
+}
+
+static void column_argmax_neon(const double *x, size_t n, double sign,
+                               double best[4], size_t index[4]) {
+    const float64x2_t factor = vdupq_n_f64(sign);
+    const float64x2_t step = vdupq_n_f64(4.0);
+    float64x2_t b0 = vld1q_f64(best), b1 = vld1q_f64(best + 2);
+    float64x2_t i0 = vdupq_n_f64((double)n), i1 = i0;
+    const double start[4] = { 0.0, 1.0, 2.0, 3.0 };
+    float64x2_t idx0 = vld1q_f64(start), idx1 = vld1q_f64(start + 2);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float64x2_t v0 = vmulq_f64(vld1q_f64(x + i), factor);
+        float64x2_t v1 = vmulq_f64(vld1q_f64(x + i + 2), factor);
+        uint64x2_t g0 = vcgtq_f64(v0, b0);
+        uint64x2_t g1 = vcgtq_f64(v1, b1);
+        b0 = vbslq_f64(g0, v0, b0);
+        b1 = vbslq_f64(g1, v1, b1);
+        i0 = vbslq_f64(g0, idx0, i0);
+        i1 = vbslq_f64(g1, idx1, i1);
+        idx0 = vaddq_f64(idx0, step);
+        idx1 = vaddq_f64(idx1, step);
+    }
+    double lanes[4];
+    vst1q_f64(best, b0);
+    vst1q_f64(best + 2, b1);
+    vst1q_f64(lanes, i0);
+    vst1q_f64(lanes + 2, i1);
+    for (int l = 0; l < 4; l++) {
+        index[l] = (size_t)lanes[l];
+    }
+    column_argmax_scalar(x + i, n - i, sign, i, best, index);
+}
+
+#endif
+
+// Picks the kernels once at startup
+static int detect_simd(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_NONE;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    return SIMD_NEON;
+#else
+    return SIMD_NONE;
+#endif
+}
+
+// Compensated sum of x[0..n), returned as hi + lo
+static void column_sum(const double *x, size_t n, double *hi, double *lo) {
+    double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+    double comp[4] = { 0.0, 0.0, 0.0, 0.0 };
+#if defined(__x86_64__) || defined(__i386__)
+    if (options.simd == SIMD_AVX2) {
+        column_sum_avx2(x, n, sum, comp);
+    } else
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    if (options.simd == SIMD_NEON) {
+        column_sum_neon(x, n, sum, comp);
+    } else
+#endif
+    {
+        column_sum_scalar(x, n, sum, comp);
+    }
+
+    // Fold the lanes in a fixed order
+    double total = 0.0;
+    double total_comp = 0.0;
+    for (int l = 0; l < 4; l++) {
+        neumaier_add(&total, &total_comp, sum[l]);
+        total_comp += comp[l];
+    }
+    *hi = total;
+    *lo = isfinite(total) ? total_comp : 0.0;  // inf - inf in the compensation
+}
+
+// Number of set flags (each 0 or 1) in flags[0..n)
+static size_t column_count(const unsigned char *flags, size_t n) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (options.simd == SIMD_AVX2) return column_count_avx2(flags, n);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    if (options.simd == SIMD_NEON) return column_count_neon(flags, n);
+#endif
+    return column_count_scalar(flags, n);
+}
+
+// Index of the first maximum (sign = 1) or minimum (sign = -1) of x, n if there is none
+static size_t column_argmax(const double *x, size_t n, double sign) {
+    double best[4] = { -INFINITY, -INFINITY, -INFINITY, -INFINITY };
+    size_t index[4] = { n, n, n, n };
+#if defined(__x86_64__) || defined(__i386__)
+    if (options.simd == SIMD_AVX2) {
+        column_argmax_avx2(x, n, sign, best, index);
+    } else
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    if (options.simd == SIMD_NEON) {
+        column_argmax_neon(x, n, sign, best, index);
+    } else
+#endif
+    {
+        column_argmax_scalar(x, n, sign, 0, best, index);
+    }
+
+    size_t found = n;
+    double value = -INFINITY;
+    for (int l = 0; l < 4; l++) {
+        if (index[l] < n && (found == n || best[l] > value ||
+                             (best[l] == value && index[l] < found))) {
+            found = index[l];
+            value = best[l];
+        }
+    }
+    return found;
+}
+
+// Folds n consecutive rows of one state into info
+static void reduce_columns(struct climate_info *info, const struct column_view *rows, size_t n) {
+    const double *temperature = rows->temperature;
+    double hi, lo;
+
+    info->num_records += n;
+    column_sum(temperature, n, &hi, &lo);
+    neumaier_add(&info->sum_temperature, &info->temperature_error, hi);
+    info->temperature_error += lo;
+    column_sum(rows->humidity, n, &hi, &lo);
+    neumaier_add(&info->sum_humidity, &info->humidity_error, hi);
+    info->humidity_error += lo;
+    column_sum(rows->cloudcover, n, &hi, &lo);
+    neumaier_add(&info->sum_cloudcover, &info->cloudcover_error, hi);
+    info->cloudcover_error += lo;
+    add_count(&info->lightning_strikes, &info->lightning_high, column_count(rows->lightning, n));
+    add_count(&info->snow_records, &info->snow_high, column_count(rows->snow, n));
+
+    size_t i = column_argmax(temperature, n, 1.0);
+    if (i < n && temperature[i] > info->max_temp) {
+        info->max_temp = temperature[i];
+        info->max_temp_time = rows->timestamp[i] / 1000;
+    }
+    i = column_argmax(temperature, n, -1.0);
+    if (i < n && temperature[i] < info->min_temp) {
+        info->min_temp = temperature[i];
+        info->min_temp_time = rows->timestamp[i] / 1000;
+    }
+    if (options.metrics) {
+        reduce_metrics(info, rows, n);
+    }
+}
+
+// Folds the selected metrics of n consecutive rows of one state into info, a batch at a time
+static void reduce_metrics(struct climate_info *info, const struct column_view *rows, size_t n) {
+    double hi, lo;
+    if (options.metrics & METRIC_PRESSURE) {
+        column_sum(rows->pressure, n, &hi, &lo);
+        info->sum_pressure += hi + lo;
+    }
+    for (size_t begin = 0; begin < n && (options.metrics & ~METRIC_PRESSURE); begin += BATCH_ROWS) {
+        size_t count = n - begin < BATCH_ROWS ? n - begin : BATCH_ROWS;
+        const double *temperature = rows->temperature + begin;
+        const double *humidity = rows->humidity + begin;
+        double derived[BATCH_ROWS];
+        if (options.metrics & METRIC_DEW_POINT) {
+            // Computed for every row (a humidity of 0 as 100), then masked: a select
+            // around dew_point would be turned into a branch, which does not vectorize
+            size_t with_dew_point = 0;
+            for (size_t i = 0; i < count; i++) {
+                derived[i] = dew_point(temperature[i], humidity[i] + 100.0 * (double)(humidity[i] <= 0.0));
+            }
+            for (size_t i = 0; i < count; i++) {
+                derived[i] = humidity[i] > 0.0 ? derived[i] : 0.0;
+                with_dew_point += (size_t)(humidity[i] > 0.0);
+            }
+            column_sum(derived, count, &hi, &lo);
+            info->sum_dew_point += hi + lo;
+            info->dew_point_records += with_dew_point;
+        }
+        if (options.metrics & METRIC_HEAT_INDEX) {
+            for (size_t i = 0; i < count; i++) {
+                derived[i] = heat_index(temperature[i], humidity[i]);
+            }
+            column_sum(derived, count, &hi, &lo);
+            info->sum_heat_index += hi + lo;
+        }
+    }
+}
+
+// View of rows [begin, ...) of a batch
+static struct column_view batch_view(const struct column_batch *batch, size_t begin) {
+    struct column_view view;
+    view.timestamp = batch->timestamp + begin;
+    view.temperature = batch->temperature + begin;
+    view.humidity = batch->humidity + begin;
+    view.cloudcover = batch->cloudcover + begin;
+    view.pressure = batch->pressure + begin;
+    view.snow = batch->snow + begin;
+    view.lightning = batch->lightning + begin;
+    return view;
+}
+
+static struct columnar_buffer *new_columns(void) {
+    struct columnar_buffer *columns = malloc(sizeof(*columns));
+    if (columns == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+    columns->rows.count = 0;
+    columns->start = NULL;
+    columns->reserved = 0;
+    return columns;
+}
+
+static void free_columns(struct columnar_buffer *columns) {
+    if (columns != NULL) {
+        free(columns->start);
+        free(columns);
+    }
+}
+
+// Reduces the pending batch into table and empties it; returns 0 on success
+static int flush_columns(struct state_table *table, struct columnar_buffer *columns) {
+    struct column_batch *rows = &columns->rows;
+    size_t n = rows->count;
+    rows->count = 0;
+    if (n == 0) {
+        return 0;
+    }
+
+    size_t i = 1;
+    while (i < n && rows->slot[i] == rows->slot[0]) {
+        i++;
+    }
+    if (i == n) {
+        struct column_view view = batch_view(rows, 0);
+        reduce_columns(table->states[rows->slot[0]], &view, n);
+        return 0;
+    }
+
+    // Several states: group the rows by state, keeping their order within a state
+    struct column_batch *grouped = &columns->grouped;
+    size_t states = (size_t)table->num_states;
+    size_t *start = reserve_array(columns->start, &columns->reserved, 2 * states + 1, sizeof(size_t));
+    if (start == NULL) {
+        return -1;
+    }
+    columns->start = start;
+    size_t *next = start + states + 1;
+    memset(start, 0, (states + 1) * sizeof(size_t));
+    for (i = 0; i < n; i++) {
+        start[rows->slot[i] + 1]++;
+    }
+    for (size_t s = 0; s < states; s++) {
+        start[s + 1] += start[s];
+    }
+    memcpy(next, start, states * sizeof(size_t));
+    for (i = 0; i < n; i++) {
+        size_t j = next[rows->slot[i]]++;
+        grouped->timestamp[j] = rows->timestamp[i];
+        grouped->temperature[j] = rows->temperature[i];
+        grouped->humidity[j] = rows->humidity[i];
+        grouped->cloudcover[j] = rows->cloudcover[i];
+        grouped->pressure[j] = rows->pressure[i];
+        grouped->snow[j] = rows->snow[i];
+        grouped->lightning[j] = rows->lightning[i];
+    }
+    for (int s = 0; s < table->num_states; s++) {
+        if (start[s + 1] > start[s]) {
+            struct column_view view = batch_view(grouped, start[s]);
+            reduce_columns(table->states[s], &view, start[s + 1] - start[s]);
+        }
+    }
+    return 0;
+}
+
+// Queues an accepted row; the batch is reduced once it is full. Returns 0 on success
+static int append_columns(struct state_table *table, struct columnar_buffer *columns,
+                           int slot, const struct tdv_record *rec) {
+    struct column_batch *rows = &columns->rows;
+    size_t i = rows->count++;
+    rows->slot[i] = slot;
+    rows->timestamp[i] = rec->timestamp;
+    rows->temperature[i] = rec->temperature;
+    rows->humidity[i] = rec->humidity;
+    rows->cloudcover[i] = rec->cloudcover;
+    rows->pressure[i] = rec->pressure;
+    rows->snow[i] = rec->snow > 0;
+    rows->lightning[i] = rec->lightning > 0;
+    return rows->count == BATCH_ROWS ? flush_columns(table, columns) : 0;
+}
+
+/*
+ * Binary cache (.tdvc). A cache holds the accepted rows of one TDV file in
+ * file order, so aggregating it gives exactly the result of parsing the
+ * text. Layout, in native byte order:
+ *
+ *      struct cache_header                     64 bytes
+ *      blocks of up to CACHE_BLOCK_ROWS rows, each 64-byte aligned:
+ *          struct cache_block                  64 bytes
+ *          uint64_t timestamp[n]
+ *          double temperature[n], humidity[n], cloudcover[n], pressure[n]
+ *          uint16_t state[n]                   index into the dictionary
+ *          uint8_t snow[n], lightning[n]       0 or 1
+ *      state dictionary                        num_codes * 4 bytes
+ *
+ * The dictionary lists codes in first-seen order. A sidecar cache is only
+ * used while the size and mtime of its source still match the header.
+ */
+
+// Byte offsets of the columns of an n-row block, and the padded block size
+static void cache_block_layout(uint64_t n, uint64_t offsets[CACHE_COLUMNS], uint64_t *size) {
+    uint64_t at = sizeof(struct cache_block);
+    for (int c = 0; c < 5; c++) {  // timestamp and the four doubles
+        offsets[c] = at;
+        at += 8 * n;
+    }
+    offsets[5] = at;  // state
+    at += 2 * n;
+    offsets[6] = at;  // snow
+    at += n;
+    offsets[7] = at;  // lightning
+    at += n;
+    *size = (at + 63) / 64 * 64;
+}
+
+static void cache_source_stamp(const struct stat *st, struct cache_header *header) {
+    header->source_size = (uint64_t)st->st_size;
+    header->source_mtime_sec = (int64_t)st->st_mtim.tv_sec;
+    header->source_mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+}
+
+// Rows of the block being written by build_cache
+struct cache_writer {
+    FILE *out;
+    uint32_t num_rows;
+    uint32_t num_blocks;
+    uint64_t min_timestamp;    // Zone map of the block so far
+    uint64_t max_timestamp;
+    uint64_t states;
+    uint64_t timestamp[CACHE_BLOCK_ROWS];
+    double temperature[CACHE_BLOCK_ROWS];
+    double humidity[CACHE_BLOCK_ROWS];
+    double cloudcover[CACHE_BLOCK_ROWS];
+    double pressure[CACHE_BLOCK_ROWS];
+    uint16_t state[CACHE_BLOCK_ROWS];
+    unsigned char snow[CACHE_BLOCK_ROWS];
+    unsigned char lightning[CACHE_BLOCK_ROWS];
+};
+
+static int write_cache_block(struct cache_writer *w) {
+    static const char padding[64];
+    uint64_t offsets[CACHE_COLUMNS], size;
+    size_t n = w->num_rows;
+    cache_block_layout(n, offsets, &size);
+
+    struct cache_block block = { 0 };
+    block.num_rows = w->num_rows;
+    block.size = size;
+    block.min_timestamp = w->min_timestamp;
+    block.max_timestamp = w->max_timestamp;
+    block.states = w->states;
+    int ok = fwrite(&block, sizeof(block), 1, w->out) == 1 &&
+             fwrite(w->timestamp, sizeof(uint64_t), n, w->out) == n &&
+             fwrite(w->temperature, sizeof(double), n, w->out) == n &&
+             fwrite(w->humidity, sizeof(double), n, w->out) == n &&
+             fwrite(w->cloudcover, sizeof(double), n, w->out) == n &&
+             fwrite(w->pressure, sizeof(double), n, w->out) == n &&
+             fwrite(w->state, sizeof(uint16_t), n, w->out) == n &&
+             fwrite(w->snow, 1, n, w->out) == n &&
+             fwrite(w->lightning, 1, n, w->out) == n;
+    size_t pad = (size_t)(size - offsets[7] - n);
+    ok = ok && fwrite(padding, 1, pad, w->out) == pad;
+
+    w->num_rows = 0;
+    w->num_blocks++;
+    w->min_timestamp = UINT64_MAX;
+    w->max_timestamp = 0;
+    w->states = 0;
+    return ok ? 0 : -1;
+}
+
+/*
+ * Converts the TDV file at path into its sidecar cache path.tdvc. The rows
+ * are written through a temporary file that is renamed into place, so a
+ * reader never sees a half-written cache. Returns 0 on success.
+ */
+int build_cache(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open file: %s\n", path);
+        return -1;
+    }
+    struct stat st;
+    size_t size = 0;
+    char *data = fstat(fileno(file), &st) == 0 ? map_file(file, &size) : NULL;
+    fclose(file);
+    if (data == NULL) {
+        fprintf(stderr, "Cannot build a cache for %s: not a non-empty regular file\n", path);
+        return -1;
+    }
+    if (compression_of(data, size) != COMPRESSION_NONE) {
+        fprintf(stderr, "Cannot build a cache for %s: decompress it first\n", path);
+        munmap(data, size);
+        return -1;
+    }
+
+    size_t path_len = strlen(path);
+    char *cache_path = malloc(path_len + sizeof(CACHE_SUFFIX) + 4);
+    struct cache_writer *w = malloc(sizeof(*w));
+    char (*codes)[4] = NULL;
+    if (cache_path == NULL || w == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(cache_path);
+        free(w);
+        munmap(data, size);
+        return -1;
+    }
+    memcpy(cache_path, path, path_len);
+    memcpy(cache_path + path_len, CACHE_SUFFIX ".tmp", sizeof(CACHE_SUFFIX) + 4);
+
+    struct cache_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.byte_order = CACHE_BYTE_ORDER;
+    cache_source_stamp(&st, &header);
+
+    int ok = (w->out = fopen(cache_path, "wb")) != NULL &&
+             fwrite(&header, sizeof(header), 1, w->out) == 1;
+    w->num_rows = 0;
+    w->num_blocks = 0;
+    w->min_timestamp = UINT64_MAX;
+    w->max_timestamp = 0;
+    w->states = 0;
+
+    // Dictionary of codes, indexed like the states of a table
+    struct key_index dictionary = { NULL, NULL, 0, 0, 0 };
+    uint32_t num_codes = 0, max_codes = 0;
+
+    const char *p = data;
+    const char *end = data + size;
+    while (ok && p < end) {
+        const char *line;
+        size_t len;
+        struct tdv_record rec;
+        if (!next_line(&p, end, &line, &len) || read_record(line, len, &rec) != 0) {
+            continue;
+        }
+
+        uint64_t key = code_key(rec.state_code);
+        long found = key_find(&dictionary, key);
+        uint32_t code = found >= 0 ? (uint32_t)found : num_codes;
+        if (code == num_codes) {
+            if (num_codes == UINT16_MAX) {
+                continue;  // More distinct codes than the state column can index
+            }
+            if (num_codes == max_codes) {
+                max_codes = max_codes ? max_codes * 2 : 64;
+                char (*grown)[4] = realloc(codes, max_codes * sizeof(*codes));
+                if (grown == NULL) {
+                    fprintf(stderr, "Error: Memory allocation failed\n");
+                    ok = 0;
+                    break;
+                }
+                codes = grown;
+            }
+            if (key_insert(&dictionary, key) < 0) {
+                ok = 0;
+                break;
+            }
+            memset(codes[num_codes], 0, sizeof(codes[num_codes]));
+            memcpy(codes[num_codes], rec.state_code, 2);
+            num_codes++;
+        }
+
+        uint32_t i = w->num_rows++;
+        w->timestamp[i] = rec.timestamp;
+        w->temperature[i] = rec.temperature;
+        w->humidity[i] = rec.humidity;
+        w->cloudcover[i] = rec.cloudcover;
+        w->pressure[i] = rec.pressure;
+        w->state[i] = (uint16_t)code;
+        w->snow[i] = rec.snow > 0;
+        w->lightning[i] = rec.lightning > 0;
+        if (rec.timestamp < w->min_timestamp) w->min_timestamp = rec.timestamp;
+        if (rec.timestamp > w->max_timestamp) w->max_timestamp = rec.timestamp;
+        w->states |= 1ULL << (code % 64);
+        header.num_rows++;
+        if (w->num_rows == CACHE_BLOCK_ROWS) {
+            ok = write_cache_block(w) == 0;
+        }
+    }
+    munmap(data, size);
+
+    if (ok && w->num_rows > 0) {
+        ok = write_cache_block(w) == 0;
+    }
+    if (ok) {
+        header.num_codes = num_codes;
+        header.num_blocks = w->num_blocks;
+        header.dict_offset = (uint64_t)ftello(w->out);
+        ok = fwrite(codes, sizeof(*codes), num_codes, w->out) == num_codes &&
+             fseeko(w->out, 0, SEEK_SET) == 0 &&
+             fwrite(&header, sizeof(header), 1, w->out) == 1;
+    }
+    if (w->out != NULL && fclose(w->out) != 0) {
+        ok = 0;
+    }
+
+    char *tmp_path = cache_path;
+    char *final_path = NULL;
+    if (ok && (final_path = malloc(path_len + sizeof(CACHE_SUFFIX))) != NULL) {
+        memcpy(final_path, path, path_len);
+        memcpy(final_path + path_len, CACHE_SUFFIX, sizeof(CACHE_SUFFIX));
+        ok = rename(tmp_path, final_path) == 0;
+    } else {
+        ok = 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Unable to write cache for: %s\n", path);
+        remove(tmp_path);
+    }
+
+    free(final_path);
+    free(tmp_path);
+    free(codes);
+    free_keys(&dictionary);
+    free(w);
+    return ok ? 0 : -1;
+}
+
+// Checks the header and block chain of a mapped cache and fills in the block index
+static int validate_cache(struct cache_map *cache) {
+    const struct cache_header *header = (const struct cache_header *)cache->data;
+    if (cache->size < sizeof(*header) || memcmp(header->magic, CACHE_MAGIC, 8) != 0 ||
+        header->version != CACHE_VERSION || header->byte_order != CACHE_BYTE_ORDER ||
+        header->dict_offset < sizeof(*header) || header->dict_offset > cache->size ||
+        (cache->size - header->dict_offset) / 4 < header->num_codes) {
+        return -1;
+    }
+
+    cache->header = header;
+    cache->codes = (const char (*)[4])(cache->data + header->dict_offset);
+    cache->blocks = malloc(sizeof(size_t) * ((size_t)header->num_blocks + 1));
+    if (cache->blocks == NULL) {
+        return -1;
+    }
+
+    uint64_t at = sizeof(*header);
+    uint64_t rows = 0;
+    uint32_t b = 0;
+    for (; b < header->num_blocks; b++) {
+        uint64_t offsets[CACHE_COLUMNS], size;
+        if (header->dict_offset - at < sizeof(struct cache_block)) {
+            break;
+        }
+        const struct cache_block *block = (const struct cache_block *)(cache->data + at);
+        cache_block_layout(block->num_rows, offsets, &size);
+        if (block->num_rows > CACHE_BLOCK_ROWS || block->size != size ||
+            header->dict_offset - at < size) {
+            break;
+        }
+        cache->blocks[b] = (size_t)at;
+        at += size;
+        rows += block->num_rows;
+    }
+    cache->blocks[header->num_blocks] = (size_t)at;
+    // A chain that ends early would leave blocks[] partly unset
+    if (b != header->num_blocks || at != header->dict_offset || rows != header->num_rows) {
+        free(cache->blocks);
+        return -1;
+    }
+    return 0;
+}
+
+// Maps fd as a cache if it is one; returns 0 on success
+static int map_cache(int fd, struct cache_map *cache) {
+    char magic[8];
+    struct stat st;
+    if (pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) ||
+        memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 || fstat(fd, &st) != 0 ||
+        !S_ISREG(st.st_mode) || (unsigned long long)st.st_size > SIZE_MAX) {
+        return -1;
+    }
+    cache->size = (size_t)st.st_size;
+    void *data = mmap(NULL, cache->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    cache->data = data;
+    if (validate_cache(cache) != 0) {
+        fprintf(stderr, "Warning: Ignoring corrupt cache file\n");
+        munmap(data, cache->size);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Opens the cache to use for the file at path (open as fd): the file itself
+ * if it is a cache, otherwise an up-to-date path.tdvc sidecar. Returns 0 if
+ * there is one.
+ */
+int open_cache(const char *path, int fd, struct cache_map *cache) {
+    if (map_cache(fd, cache) == 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    size_t path_len = strlen(path);
+    char *cache_path = malloc(path_len + sizeof(CACHE_SUFFIX));
+    if (cache_path == NULL) {
+        return -1;
+    }
+    memcpy(cache_path, path, path_len);
+    memcpy(cache_path + path_len, CACHE_SUFFIX, sizeof(CACHE_SUFFIX));
+    FILE *sidecar = fopen(cache_path, "r");
+    free(cache_path);
+    if (sidecar == NULL) {
+        return -1;
+    }
+    int result = map_cache(fileno(sidecar), cache);
+    fclose(sidecar);
+    if (result != 0) {
+        return -1;
+    }
+
+    struct cache_header stamp;
+    cache_source_stamp(&st, &stamp);
+    if (cache->header->source_size != stamp.source_size ||
+        cache->header->source_mtime_sec != stamp.source_mtime_sec ||
+        cache->header->source_mtime_nsec != stamp.source_mtime_nsec) {
+        close_cache(cache);  // Stale: the source changed since the cache was built
+        return -1;
+    }
+    return 0;
+}
+
+void close_cache(struct cache_map *cache) {
+    munmap((void *)cache->data, cache->size);
+    free(cache->blocks);
+}
+
+// Column arrays of a mapped block
+static struct column_view cache_block_view(const struct cache_map *cache, size_t b,
+                                           const uint16_t **state, size_t *num_rows) {
+    const char *base = cache->data + cache->blocks[b];
+    const struct cache_block *block = (const struct cache_block *)base;
+    uint64_t offsets[CACHE_COLUMNS], size;
+    cache_block_layout(block->num_rows, offsets, &size);
+
+    struct column_view view;
+    view.timestamp = (const uint64_t *)(base + offsets[0]);
+    view.temperature = (const double *)(base + offsets[1]);
+    view.humidity = (const double *)(base + offsets[2]);
+    view.cloudcover = (const double *)(base + offsets[3]);
+    view.pressure = (const double *)(base + offsets[4]);
+    *state = (const uint16_t *)(base + offsets[5]);
+    view.snow = (const unsigned char *)(base + offsets[6]);
+    view.lightning = (const unsigned char *)(base + offsets[7]);
+    *num_rows = block->num_rows;
+    return view;
+}
+
+/*
+ * Folds blocks [first, first + count) of a cache into table, straight from
+ * the mapping. States are created lazily on their first row, as the text
+ * path does. Returns the number of rows used, or -1 on error.
+ */
+static long scan_cache(const struct cache_map *cache, size_t first, size_t count,
+                       struct state_table *table) {
+    uint32_t num_codes = cache->header->num_codes;
+    int *slots = malloc(sizeof(int) * (num_codes + 1));
+    if (slots == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    // Codes the --states filter takes, as in the blocks' zone maps
+    uint64_t wanted = options.filter_states ? 0 : UINT64_MAX;
+    for (uint32_t c = 0; c < num_codes; c++) {
+        int taken = code_wanted(cache->codes[c]);
+        slots[c] = taken ? -3 : -4;  // Not looked up yet, or filtered out
+        wanted |= taken ? 1ULL << (c % 64) : 0;
+    }
+
+    long lines_processed = 0;
+    for (size_t b = first; b < first + count; b++) {
+        const struct cache_block *block = (const struct cache_block *)(cache->data + cache->blocks[b]);
+        if ((block->states & wanted) == 0 || block->min_timestamp >= options.to_ms ||
+            block->max_timestamp < options.from_ms) {
+            // No row of the block can pass the filters: skip it unread
+            table->stats.lines += block->num_rows;
+            table->stats.skipped[SKIP_FILTERED] += block->num_rows;
+            continue;
+        }
+        int whole = block->min_timestamp >= options.from_ms && block->max_timestamp < options.to_ms;
+
+        const uint16_t *state;
+        size_t n;
+        struct column_view view = cache_block_view(cache, b, &state, &n);
+        uint64_t start = stage_clock();
+        table->stats.bytes += cache->blocks[b + 1] - cache->blocks[b];
+        table->stats.lines += n;
+
+        for (size_t i = 0; i < n; ) {
+            // A run of rows of one state that are all inside or all outside the time range
+            int inside = whole || (view.timestamp[i] >= options.from_ms &&
+                                   view.timestamp[i] < options.to_ms);
+            size_t run = i + 1;
+            while (run < n && state[run] == state[i] &&
+                   (whole || (view.timestamp[run] >= options.from_ms &&
+                              view.timestamp[run] < options.to_ms) == inside)) {
+                run++;
+            }
+
+            uint16_t code = state[i];
+            if (code >= num_codes) {
+                fprintf(stderr, "Warning: Corrupt state index in cache\n");
+                free(slots);
+                return -1;
+            }
+            if (!inside || slots[code] == -4) {
+                table->stats.skipped[SKIP_FILTERED] += run - i;
+                i = run;
+                continue;
+            }
+            if (slots[code] == -3) {
+                slots[code] = find_state(table, cache->codes[code]);
+            }
+            if (slots[code] == -1) {
+                free(slots);
+                return -1;
+            }
+            struct climate_info *info = table->states[slots[code]];
+            if (options.columnar) {
+                struct column_view rows = view;
+                rows.timestamp += i;
+                rows.temperature += i;
+                rows.humidity += i;
+                rows.cloudcover += i;
+                rows.pressure += i;
+                rows.snow += i;
+                rows.lightning += i;
+                reduce_columns(info, &rows, run - i);
+            } else {
+                for (size_t r = i; r < run; r++) {
+                    update_state(info, view.temperature[r], view.humidity[r],
+                                 view.cloudcover[r], view.lightning[r], view.snow[r],
+                                 view.timestamp[r]);
+                }
+                for (size_t r = i; options.metrics && r < run; r++) {
+                    update_metrics(info, view.temperature[r], view.humidity[r], view.pressure[r]);
+                }
+            }
+            for (size_t r = i; options.buckets && r < run; r++) {
+                if (add_to_series(&table->series, slots[code], view.temperature[r],
+                                  view.humidity[r], view.cloudcover[r], view.lightning[r],
+                                  view.snow[r], view.timestamp[r]) != 0) {
+                    free(slots);
+                    return -1;
+                }
+            }
+            for (size_t r = i; options.quantiles && r < run; r++) {
+                if (add_to_sketch(table, slots[code], view.temperature[r], view.humidity[r]) != 0) {
+                    free(slots);
+                    return -1;
+                }
+            }
+            lines_processed += (long)(run - i);
+            table->stats.used += run - i;
+            i = run;
+        }
+        table->stats.ticks[STAGE_AGGREGATE] += stage_clock() - start;
+    }
+
+    free(slots);
+    return lines_processed;
+}
+
+// analyze_cache for --sample: scans the picked blocks of the cache (see analyze_sampled)
+static int analyze_sampled_cache(const struct cache_map *cache, struct state_table *table) {
+    size_t num_blocks = cache->header->num_blocks;
+    uint64_t *bounds = malloc(2 * (num_blocks ? num_blocks : 1) * sizeof(uint64_t));
+    if (bounds == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t b = 0; b < num_blocks; b++) {
+        if (sample_picked(b, cache->size)) {
+            bounds[2 * n] = b;
+            bounds[2 * n + 1] = b + 1;
+            n++;
+        }
+    }
+    long result = run_sampled(NULL, cache, bounds, n, sample_bytes(cache, 0, num_blocks), table);
+    free(bounds);
+    return (result > 0) ? 0 : -1;  // Return success if any lines were processed
+}
+
+// Aggregates a mapped cache, splitting its blocks into chunk tasks like analyze_buffer
+int analyze_cache(const struct cache_map *cache, struct state_table *table) {
+    size_t num_blocks = cache->header->num_blocks;
+    if (options.sample > 0 && (double)num_blocks * options.sample >= SAMPLE_MIN_BLOCKS) {
+        return analyze_sampled_cache(cache, table);
+    }
+    size_t num_chunks = chunk_count(cache->size);
+    if (num_chunks > num_blocks) num_chunks = num_blocks;
+    if (num_chunks < 2) {
+        long lines_processed = scan_cache(cache, 0, num_blocks, table);
+        return (lines_processed > 0) ? 0 : -1;  // Return success if any lines were processed
+    }
+
+    struct chunk_job *jobs = calloc(num_chunks, sizeof(struct chunk_job));
+    if (jobs == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    for (size_t i = 0; i < num_chunks; i++) {
+        jobs[i].scan = scan_cache_chunk;
+        jobs[i].cache = cache;
+        jobs[i].first_block = num_blocks * i / num_chunks;
+        jobs[i].num_blocks = num_blocks * (i + 1) / num_chunks - jobs[i].first_block;
+    }
+
+    long result = run_chunks(jobs, num_chunks, table);
+    free(jobs);
+    return (result > 0) ? 0 : -1;  // Return success if any lines were processed
+}
+
+/*
+ * Index sidecar (.tdvi). TDV files are not in time order, so a time window
+ * can only be found by looking at every line. The index lists the accepted
+ * lines of a file per state code and, within a code, by timestamp, each
+ * with the byte offset where it starts. Layout, in native byte order:
+ *
+ *      struct index_header                     56 bytes
+ *      struct index_code[num_codes]            in first-seen order
+ *      struct index_entry[num_entries]         by code, timestamp and offset
+ *
+ * A filtered run binary-searches the entries of every wanted code for the
+ * window, sorts the offsets it finds back into file order and parses just
+ * those lines out of the mapped file (see analyze_indexed). Only their
+ * pages are read, and the result is the one of a full scan. The accepted
+ * lines left out count as filtered in --stats; lines that never were
+ * accepted are not counted, as with a cache. A sidecar index is only used
+ * while the size and mtime of its source still match the header.
+ */
+
+// An accepted line while build_index sorts them
+struct index_row {
+    uint64_t timestamp;
+    uint64_t offset;
+    uint32_t code;             // Position in the index's code list
+};
+
+static int compare_index_rows(const void *a, const void *b) {
+    const struct index_row *x = a;
+    const struct index_row *y = b;
+    if (x->code != y->code) {
+        return x->code < y->code ? -1 : 1;
+    }
+    if (x->timestamp != y->timestamp) {
+        return x->timestamp < y->timestamp ? -1 : 1;
+    }
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Writes the sorted rows as index entries; returns 0 on success
+static int write_index_entries(FILE *out, const struct index_row *rows, size_t n) {
+    struct index_entry buffer[4096];
+    for (size_t done = 0; done < n; ) {
+        size_t count = n - done < 4096 ? n - done : 4096;
+        for (size_t i = 0; i < count; i++) {
+            buffer[i].timestamp = rows[done + i].timestamp;
+            buffer[i].offset = rows[done + i].offset;
+        }
+        if (fwrite(buffer, sizeof(buffer[0]), count, out) != count) {
+            return -1;
+        }
+        done += count;
+    }
+    return 0;
+}
+
+/*
+ * Writes the index sidecar path.tdvi of the TDV file at path, through a
+ * temporary file that is renamed into place like a cache. Returns 0 on
+ * success.
+ */
+int build_index(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open file: %s\n", path);
+        return -1;
+    }
+    struct stat st;
+    size_t size = 0;
+    char *data = fstat(fileno(file), &st) == 0 ? map_file(file, &size) : NULL;
+    fclose(file);
+    if (data == NULL) {
+        fprintf(stderr, "Cannot build an index for %s: not a non-empty regular file\n", path);
+        return -1;
+    }
+    if (compression_of(data, size) != COMPRESSION_NONE) {
+        fprintf(stderr, "Cannot build an index for %s: decompress it first\n", path);
+        munmap(data, size);
+        return -1;
+    }
+
+    struct key_index dictionary = { NULL, NULL, 0, 0, 0 };
+    struct index_code *codes = NULL;
+    size_t codes_reserved = 0;
+    struct index_row *rows = NULL;
+    size_t num_rows = 0, rows_reserved = 0;
+    int ok = 1;
+
+    const char *p = data;
+    const char *end = data + size;
+    while (p < end) {
+        const char *line;
+        size_t len;
+        struct tdv_record rec;
+        if (!next_line(&p, end, &line, &len) || read_record(line, len, &rec) != 0) {
+            continue;
+        }
+        long code = key_insert(&dictionary, code_key(rec.state_code));
+        struct index_code *grown_codes = code < 0 ? NULL
+            : reserve_array(codes, &codes_reserved, dictionary.count, sizeof(*codes));
+        if (grown_codes == NULL) {
+            ok = 0;
+            break;
+        }
+        codes = grown_codes;
+        struct index_row *grown_rows = reserve_array(rows, &rows_reserved, num_rows + 1, sizeof(*rows));
+        if (grown_rows == NULL) {
+            ok = 0;
+            break;
+        }
+        rows = grown_rows;
+        if (codes[code].count++ == 0) {
+            memcpy(codes[code].code, rec.state_code, 2);  // New: the rest was zeroed by reserve_array
+        }
+        rows[num_rows].timestamp = rec.timestamp;
+        rows[num_rows].offset = (uint64_t)(line - data);
+        rows[num_rows].code = (uint32_t)code;
+        num_rows++;
+    }
+    munmap(data, size);
+
+    uint64_t first = 0;
+    for (size_t c = 0; ok && c < dictionary.count; c++) {
+        codes[c].first = first;
+        first += codes[c].count;
+    }
+    if (ok && num_rows > 1) {
+        qsort(rows, num_rows, sizeof(*rows), compare_index_rows);
+    }
+
+    size_t path_len = strlen(path);
+    char *index_path = malloc(path_len + sizeof(INDEX_SUFFIX));
+    char *tmp_path = malloc(path_len + sizeof(INDEX_SUFFIX) + 4);
+    if (ok && (index_path == NULL || tmp_path == NULL)) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        ok = 0;
+    }
+    FILE *out = NULL;
+    if (ok) {
+        memcpy(index_path, path, path_len);
+        memcpy(index_path + path_len, INDEX_SUFFIX, sizeof(INDEX_SUFFIX));
+        memcpy(tmp_path, index_path, path_len + sizeof(INDEX_SUFFIX) - 1);
+        memcpy(tmp_path + path_len + sizeof(INDEX_SUFFIX) - 1, ".tmp", 5);
+
+        struct cache_header stamp;
+        cache_source_stamp(&st, &stamp);
+        struct index_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+        header.version = INDEX_VERSION;
+        header.byte_order = CACHE_BYTE_ORDER;
+        header.source_size = stamp.source_size;
+        header.source_mtime_sec = stamp.source_mtime_sec;
+        header.source_mtime_nsec = stamp.source_mtime_nsec;
+        header.num_entries = num_rows;
+        header.num_codes = (uint32_t)dictionary.count;
+
+        ok = (out = fopen(tmp_path, "wb")) != NULL &&
+             fwrite(&header, sizeof(header), 1, out) == 1 &&
+             fwrite(codes, sizeof(*codes), dictionary.count, out) == dictionary.count &&
+             write_index_entries(out, rows, num_rows) == 0;
+        if (out != NULL && fclose(out) != 0) {
+            ok = 0;
+        }
+        if (ok) {
+            ok = rename(tmp_path, index_path) == 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "Unable to write index for: %s\n", path);
+            remove(tmp_path);
+        }
+    }
+
+    free(index_path);
+    free(tmp_path);
+    free(codes);
+    free(rows);
+    free_keys(&dictionary);
+    return ok ? 0 : -1;
+}
+
+// Checks that a mapped index is complete and consistent; returns 0 if it is
+static int validate_index(struct index_map *index) {
+    if (index->size < sizeof(struct index_header)) {
+        return -1;
+    }
+    const struct index_header *header = (const struct index_header *)index->data;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != INDEX_VERSION || header->byte_order != CACHE_BYTE_ORDER) {
+        return -1;
+    }
+    size_t room = index->size - sizeof(struct index_header);
+    if (header->num_codes > room / sizeof(struct index_code) ||
+        header->num_entries > (room - header->num_codes * sizeof(struct index_code)) /
+                              sizeof(struct index_entry) ||
+        room != header->num_codes * sizeof(struct index_code) +
+                header->num_entries * sizeof(struct index_entry)) {
+        return -1;
+    }
+    index->header = header;
+    index->codes = (const struct index_code *)(index->data + sizeof(struct index_header));
+    index->entries = (const struct index_entry *)(index->codes + header->num_codes);
+    for (uint32_t c = 0; c < header->num_codes; c++) {
+        const struct index_code *code = &index->codes[c];
+        if (code->code[2] != '\0' || code->code[3] != '\0' || code->first > header->num_entries ||
+            code->count > header->num_entries - code->first) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Opens the index sidecar path.tdvi of the file at path (open as fd).
+ * Returns 0 if there is an up-to-date one.
+ */
+int open_index(const char *path, int fd, struct index_map *index) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    size_t path_len = strlen(path);
+    char *index_path = malloc(path_len + sizeof(INDEX_SUFFIX));
+    if (index_path == NULL) {
+        return -1;
+    }
+    memcpy(index_path, path, path_len);
+    memcpy(index_path + path_len, INDEX_SUFFIX, sizeof(INDEX_SUFFIX));
+    FILE *sidecar = fopen(index_path, "r");
+    free(index_path);
+    if (sidecar == NULL) {
+        return -1;
+    }
+    struct stat ist;
+    void *data = MAP_FAILED;
+    if (fstat(fileno(sidecar), &ist) == 0 && S_ISREG(ist.st_mode) && ist.st_size > 0 &&
+        (unsigned long long)ist.st_size <= SIZE_MAX) {
+        index->size = (size_t)ist.st_size;
+        data = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fileno(sidecar), 0);
+    }
+    fclose(sidecar);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    index->data = data;
+    if (validate_index(index) != 0) {
+        fprintf(stderr, "Warning: Ignoring corrupt index file\n");
+        munmap(data, index->size);
+        return -1;
+    }
+
+    struct cache_header stamp;
+    cache_source_stamp(&st, &stamp);
+    if (index->header->source_size != stamp.source_size ||
+        index->header->source_mtime_sec != stamp.source_mtime_sec ||
+        index->header->source_mtime_nsec != stamp.source_mtime_nsec) {
+        close_index(index);  // Stale: the source changed since the index was built
+        return -1;
+    }
+    return 0;
+}
+
+void close_index(struct index_map *index) {
+    munmap((void *)index->data, index->size);
+}
+
+// First of n entries sorted by timestamp that is at or after timestamp
+static size_t index_lower_bound(const struct index_entry *entries, size_t n, uint64_t timestamp) {
+    size_t low = 0;
+    while (n > 0) {
+        size_t half = n / 2;
+        if (entries[low + half].timestamp < timestamp) {
+            low += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+    return low;
+}
+
+/*
+ * Folds the lines starting at offsets[0..n) (in file order) of the mapped
+ * file data into table, like scan_buffer does with all of them. Returns the
+ * number of lines used, or -1 on error.
+ */
+static long scan_lines(const char *data, size_t size, const uint64_t *offsets, size_t n,
+                       struct state_table *table) {
+    long lines_processed = 0;
+    struct columnar_buffer *columns = NULL;
+    if (options.columnar && (columns = new_columns()) == NULL) {
+        return -1;
+    }
+
+    struct scan_stats *stats = &table->stats;
+    uint64_t start = stage_clock();
+    uint64_t staged = staged_ticks(stats);
+    for (size_t i = 0; i < n; i++) {
+        if (offsets[i] >= size) {
+            fprintf(stderr, "Warning: Corrupt line offset in index\n");
+            free_columns(columns);
+            return -1;
+        }
+        const char *p = data + offsets[i];
+        const char *line;
+        size_t len;
+        int usable = next_line(&p, data + size, &line, &len);
+        stats->bytes += len;
+        if (!usable) {
+            stats->lines++;
+            stats->skipped[SKIP_TOO_LONG]++;
+            continue;
+        }
+
+        int result = process_line(line, len, table, columns);
+        if (result < 0) {
+            free_columns(columns);
+            return -1;
+        }
+        lines_processed += result;
+    }
+
+    if (columns != NULL) {
+        uint64_t flush_start = stage_clock();
+        int failed = flush_columns(table, columns) != 0;
+        stats->ticks[STAGE_AGGREGATE] += stage_clock() - flush_start;
+        free_columns(columns);
+        if (failed) {
+            return -1;
+        }
+    }
+    charge_read(stats, start, staged);
+    return lines_processed;
+}
+
+/*
+ * Analyzes the lines of file that the index puts inside --from, --to and
+ * --states. The file is mapped for random access, so only the pages of
+ * those lines are read; the offsets are split into tasks like the chunks
+ * of analyze_buffer. Returns 0 on success, -1 if no line could be used.
+ */
+int analyze_indexed(FILE *file, const struct index_map *index, struct state_table *table) {
+    size_t size;
+    char *data = map_file(file, &size);
+    if (data == NULL) {
+        return analyze_file(file, table);
+    }
+    posix_madvise(data, size, POSIX_MADV_RANDOM);
+
+    // Offsets of the lines in the window, back in file order
+    uint64_t *offsets = NULL;
+    size_t n = 0, reserved = 0;
+    for (uint32_t c = 0; c < index->header->num_codes; c++) {
+        const struct index_code *code = &index->codes[c];
+        if (!code_wanted(code->code)) {
+            continue;
+        }
+        const struct index_entry *entries = index->entries + code->first;
+        size_t low = index_lower_bound(entries, (size_t)code->count, options.from_ms);
+        size_t high = options.to_ms == ULLONG_MAX ? (size_t)code->count
+                    : index_lower_bound(entries, (size_t)code->count, options.to_ms);
+        if (low >= high) {
+            continue;
+        }
+        uint64_t *grown = reserve_array(offsets, &reserved, n + (high - low), sizeof(uint64_t));
+        if (grown == NULL) {
+            free(offsets);
+            munmap(data, size);
+            return -1;
+        }
+        offsets = grown;
+        for (size_t i = low; i < high; i++) {
+            offsets[n++] = entries[i].offset;
+        }
+    }
+    if (n > 1) {
+        qsort(offsets, n, sizeof(uint64_t), compare_offsets);
+    }
+    uint64_t left_out = index->header->num_entries - n;
+    table->stats.lines += left_out;
+    table->stats.skipped[SKIP_FILTERED] += left_out;
+
+    // Split by the bytes the lines are expected to span
+    size_t line_bytes = index->header->num_entries ? size / index->header->num_entries : 0;
+    size_t num_chunks = chunk_count(n * line_bytes);
+    if (num_chunks > n) num_chunks = n;
+    long result;
+    if (num_chunks < 2) {
+        result = scan_lines(data, size, offsets, n, table);
+    } else {
+        struct chunk_job *jobs = calloc(num_chunks, sizeof(struct chunk_job));
+        if (jobs == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            result = -1;
+        } else {
+            for (size_t i = 0; i < num_chunks; i++) {
+                size_t begin = n * i / num_chunks;
+                jobs[i].scan = scan_index_chunk;
+                jobs[i].data = data;
+                jobs[i].size = size;
+                jobs[i].offsets = offsets + begin;
+                jobs[i].num_offsets = n * (i + 1) / num_chunks - begin;
+            }
+            result = run_chunks(jobs, num_chunks, table);
+            free(jobs);
+        }
+    }
+
+    free(offsets);
+    munmap(data, size);
+    return (result > 0) ? 0 : -1;  // Return success if any lines were processed
+}
+
+/*
+ * Benchmark mode (--bench). For every file, times the parse, lookup and
+ * aggregate stages separately in batches of BATCH_ROWS lines, once for the
+ * mmap reader and once for the stdio reader, then times the whole pipeline
+ * of the mmap reader and of the file's cache (when it has a valid one) at
+ * 1, 2, 4, ... threads. Prints one row per measurement.
+ */
+
+static double bench_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Time spent in the stages, and the input the stages went over
+struct bench_stages {
+    double parse;
+    double lookup;
+    double aggregate;
+    unsigned long lines;
+    size_t bytes;
+};
+
+// Batch of parsed records between the stages
+struct bench_batch {
+    struct tdv_record rec[BATCH_ROWS];
+    int slot[BATCH_ROWS];
+    size_t count;
+};
+
+static void bench_row(const char *backend, const char *stage, int threads, double seconds,
+                      unsigned long lines, size_t bytes) {
+    printf("%-8s %-10s %7d %11.3f %11.2f %9.1f\n", backend, stage, threads, seconds,
+           seconds > 0 ? (double)lines / seconds / 1e6 : 0.0,
+           seconds > 0 ? (double)bytes / seconds / (1024.0 * 1024.0) : 0.0);
+}
+
+// Runs the lookup and aggregate stages over a parsed batch
+static int bench_fold(struct bench_batch *batch, struct state_table *table,
+                      struct columnar_buffer *columns, struct bench_stages *stages) {
+    double start = bench_clock();
+    for (size_t i = 0; i < batch->count; i++) {
+        batch->slot[i] = find_state(table, batch->rec[i].state_code);
+        if (batch->slot[i] < 0) {
+            return -1;
+        }
+    }
+    double looked_up = bench_clock();
+    for (size_t i = 0; i < batch->count; i++) {
+        const struct tdv_record *rec = &batch->rec[i];
+        if (columns != NULL) {
+            if (append_columns(table, columns, batch->slot[i], rec) != 0) {
+                return -1;
+            }
+        } else {
+            update_state(table->states[batch->slot[i]], rec->temperature, rec->humidity,
+                         rec->cloudcover, rec->lightning > 0, rec->snow > 0, rec->timestamp);
+            if (options.metrics) {
+                update_metrics(table->states[batch->slot[i]], rec->temperature, rec->humidity,
+                               rec->pressure);
+            }
+        }
+    }
+    if (columns != NULL && flush_columns(table, columns) != 0) {
+        return -1;
+    }
+    double folded = bench_clock();
+
+    stages->lookup += looked_up - start;
+    stages->aggregate += folded - looked_up;
+    batch->count = 0;
+    return 0;
+}
+
+// Stage timings for a mapped file (data != NULL) or a stdio stream; 0 on success
+static int bench_stages(FILE *file, const char *data, size_t size, struct bench_stages *stages) {
+    memset(stages, 0, sizeof(*stages));
+    static struct state_table table;
+    struct bench_batch *batch = malloc(sizeof(*batch));
+    struct columnar_buffer *columns = options.columnar ? new_columns() : NULL;
+    if (batch == NULL || (options.columnar && columns == NULL)) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(batch);
+        free_columns(columns);
+        return -1;
+    }
+    batch->count = 0;
+
+    const char *p = data;
+    const char *end = data + size;
+    char *buffer = NULL;
+    size_t buffer_size = 0;
+    int more = 1;
+    int result = 0;
+    while (more && result == 0) {
+        double start = bench_clock();
+        while (batch->count < BATCH_ROWS) {
+            const char *line;
+            size_t len;
+            if (data != NULL) {
+                if (p >= end) {
+                    more = 0;
+                    break;
+                }
+                stages->lines++;
+                if (!next_line(&p, end, &line, &len)) {
+                    continue;
+                }
+            } else {
+                ssize_t n = getline(&buffer, &buffer_size, file);
+                if (n < 0) {
+                    more = 0;
+                    break;
+                }
+                len = (size_t)n;
+                stages->lines++;
+                stages->bytes += len;
+                if (options.max_line > 0 && len - (buffer[len - 1] == '\n') > options.max_line) {
+                    continue;
+                }
+                line = buffer;
+            }
+            batch->count += read_record(line, len, &batch->rec[batch->count]) == 0;
+        }
+        stages->parse += bench_clock() - start;
+        result = bench_fold(batch, &table, columns, stages);
+    }
+    if (data != NULL) {
+        stages->bytes = size;
+    }
+
+    free(buffer);
+    free(batch);
+    free_columns(columns);
+    free_states(&table);
+    return result;
+}
+
+// 1, 2, 4, ... and finally max itself
+static int next_thread_count(int threads, int max) {
+    if (threads >= max) {
+        return max + 1;
+    }
+    return threads * 2 < max ? threads * 2 : max;
+}
+
+// Times the whole pipeline of one backend at every thread count
+static void bench_pipeline(const char *backend, FILE *file, const struct cache_map *cache,
+                           size_t bytes, unsigned long lines) {
+    for (int threads = 1; threads <= options.num_threads;
+         threads = next_thread_count(threads, options.num_threads)) {
+        static struct state_table table;
+        stop_pool();
+        start_pool(threads);
+        double start = bench_clock();
+        if (cache != NULL) {
+            analyze_cache(cache, &table);
+        } else {
+            analyze_file(file, &table);
+        }
+        double seconds = bench_clock() - start;
+        free_states(&table);
+        bench_row(backend, "pipeline", threads, seconds, lines, bytes);
+    }
+    stop_pool();
+    start_pool(options.num_threads);
+}
+
+// Benchmarks the file at path; returns 0 on success
+int bench_path(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open file: %s\n", path);
+        return -1;
+    }
+    size_t size;
+    char *data = map_file(file, &size);
+    if (data == NULL) {
+        fprintf(stderr, "Unable to map file: %s\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    struct bench_stages mapped;
+    struct bench_stages streamed;
+    // The stdio pass goes first so both passes find the file in the page cache
+    int result = bench_stages(file, NULL, 0, &streamed);
+    if (result == 0) {
+        result = bench_stages(NULL, data, size, &mapped);
+    }
+    if (result != 0) {
+        munmap(data, size);
+        fclose(file);
+        return -1;
+    }
+
+    printf("Benchmark: %s (%.1f MB, %lu lines%s)\n", path, (double)size / (1024.0 * 1024.0),
+           mapped.lines, options.columnar ? ", columnar" : "");
+    printf("%-8s %-10s %7s %11s %11s %9s\n", "backend", "stage", "threads", "seconds",
+           "Mlines/s", "MB/s");
+    const struct bench_stages *runs[2] = { &mapped, &streamed };
+    const char *names[2] = { "mmap", "stdio" };
+    for (int i = 0; i < 2; i++) {
+        bench_row(names[i], "parse", 1, runs[i]->parse, runs[i]->lines, runs[i]->bytes);
+        bench_row(names[i], "lookup", 1, runs[i]->lookup, runs[i]->lines, runs[i]->bytes);
+        bench_row(names[i], "aggregate", 1, runs[i]->aggregate, runs[i]->lines, runs[i]->bytes);
+    }
+
+    int prefetch = options.prefetch;
+    options.prefetch = 0;
+    rewind(file);
+    bench_pipeline("mmap", file, NULL, size, mapped.lines);
+    munmap(data, size);
+    options.prefetch = prefetch > 0 ? prefetch : PREFETCH_BENCH;
+    bench_pipeline("prefetch", file, NULL, size, mapped.lines);
+    options.prefetch = prefetch;
+
+    struct cache_map cache;
+    if (open_cache(path, fileno(file), &cache) == 0) {
+        bench_pipeline("cache", NULL, &cache, cache.size, mapped.lines);
+        close_cache(&cache);
+    }
+    fclose(file);
+    fflush(stdout);
+    return 0;
+}
+
+/*
+ * Report writer. Reports are formatted into large buffers and written with
+ * one fwrite per buffer instead of a printf per field. Numbers go through
+ * out_fixed and out_ulong, dates through out_ctime, which keeps the strings
+ * of recently converted times; each gives the same text as the printf
+ * conversion it stands in for. Independent parts of a report (shards, e.g.
+ * one per state) can be formatted on several threads by write_shards and
+ * are written in order.
+ */
+
+// ctime() strings of recently formatted times, direct mapped by time
+struct time_cache {
+    time_t times[TIME_CACHE_SIZE];
+    char text[TIME_CACHE_SIZE][40];  // Room for any int year
+    unsigned char len[TIME_CACHE_SIZE];  // 0 = empty slot
+};
+
+struct out_buffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+    int failed;                // An allocation failed; the output is incomplete
+    struct time_cache *times;  // NULL = convert every time
+};
+
+// Room for n more bytes at the end of out, or NULL after an allocation failure
+static char *out_reserve(struct out_buffer *out, size_t n) {
+    if (out->failed) {
+        return NULL;
+    }
+    if (out->capacity - out->len < n) {
+        size_t capacity = out->capacity ? out->capacity : OUT_INITIAL;
+        while (capacity - out->len < n) {
+            capacity *= 2;
+        }
+        char *data = realloc(out->data, capacity);
+        if (data == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            out->failed = 1;
+            return NULL;
+        }
+        out->data = data;
+        out->capacity = capacity;
+    }
+    return out->data + out->len;
+}
+
+static void out_bytes(struct out_buffer *out, const char *bytes, size_t n) {
+    char *p = out_reserve(out, n);
+    if (p != NULL) {
+        memcpy(p, bytes, n);
+        out->len += n;
+    }
+}
+
+static void out_str(struct out_buffer *out, const char *s) {
+    out_bytes(out, s, strlen(s));
+}
+
+// Like printf("%llu")
+static void out_ulong(struct out_buffer *out, unsigned long long value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[sizeof(digits) - 1 - n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    out_bytes(out, digits + sizeof(digits) - n, (size_t)n);
+}
+
+/*
+ * Like printf("%.*Lf", decimals, x) for decimals 0 to 2. Scaling by the
+ * power of ten is exact for doubles and off by at most half an ulp for long
+ * doubles, so rounding the scaled value only decides the digits when it is
+ * clearly away from a tie; near ties (and for large magnitudes, infinities
+ * and NaN) snprintf rounds the exact value instead.
+ */
+static void out_fixed(struct out_buffer *out, long double x, int decimals) {
+    static const long double scales[] = { 1.0L, 10.0L, 100.0L };
+    static const unsigned long long units[] = { 1, 10, 100 };
+    long double scaled = (x < 0 ? -x : x) * scales[decimals];
+    unsigned long long whole = scaled < FIXED_FAST_MAX ? (unsigned long long)scaled : 0;
+    long double frac = scaled - (long double)whole;
+    if (!(scaled < FIXED_FAST_MAX) || (frac > 0.5L - 1e-6L && frac < 0.5L + 1e-6L)) {
+        char text[64];
+        int n = snprintf(text, sizeof(text), "%.*Lf", decimals, x);
+        if (n > 0 && (size_t)n < sizeof(text)) {
+            out_bytes(out, text, (size_t)n);
+        } else {
+            size_t size = (size_t)(n > 0 ? n : 0) + 1;
+            char *big = out_reserve(out, size);
+            if (big != NULL) {
+                snprintf(big, size, "%.*Lf", decimals, x);
+                out->len += size - 1;
+            }
+        }
+        return;
+    }
+
+    unsigned long long rounded = whole + (frac > 0.5L);
+    if (signbit(x)) {
+        out_bytes(out, "-", 1);  // printf keeps the sign of a value that rounds to 0
+    }
+    out_ulong(out, rounded / units[decimals]);
+    if (decimals > 0) {
+        char fraction[3] = { '.', '0', '0' };
+        unsigned long long rest = rounded % units[decimals];
+        for (int i = decimals; i > 0; i--, rest /= 10) {
+            fraction[i] = (char)('0' + rest % 10);
+        }
+        out_bytes(out, fraction, (size_t)decimals + 1);
+    }
+}
+
+// Two digits with a leading zero, like printf("%.2d") for 0-99
+static void out_two(char *p, int value) {
+    p[0] = (char)('0' + value / 10 % 10);
+    p[1] = (char)('0' + value % 10);
+}
+
+// The text of ctime(&t) (local time), without its static buffer and locale lookups
+static void out_ctime(struct out_buffer *out, time_t t) {
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    size_t slot = (size_t)((unsigned long long)t % TIME_CACHE_SIZE);
+    struct time_cache *cache = out->times;
+    if (cache != NULL && cache->len[slot] != 0 && cache->times[slot] == t) {
+        out_bytes(out, cache->text[slot], cache->len[slot]);
+        return;
+    }
+
+    struct tm tm;
+    char text[40];
+    size_t n;
+    if (localtime_r(&t, &tm) == NULL || tm.tm_year > INT_MAX - 1900) {
+        out_str(out, "(null)");  // ctime() returns NULL, which printf("%s") prints so
+        return;
+    }
+    memcpy(text, days + 3 * tm.tm_wday, 3);
+    text[3] = ' ';
+    memcpy(text + 4, months + 3 * tm.tm_mon, 3);
+    text[7] = ' ';
+    text[8] = tm.tm_mday < 10 ? ' ' : (char)('0' + tm.tm_mday / 10);
+    text[9] = (char)('0' + tm.tm_mday % 10);
+    text[10] = ' ';
+    out_two(text + 11, tm.tm_hour);
+    text[13] = ':';
+    out_two(text + 14, tm.tm_min);
+    text[16] = ':';
+    out_two(text + 17, tm.tm_sec);
+    text[19] = ' ';
+    n = 20 + (size_t)snprintf(text + 20, sizeof(text) - 20, "%d\n", tm.tm_year + 1900);
+    out_bytes(out, text, n);
+    if (cache != NULL) {
+        cache->times[slot] = t;
+        memcpy(cache->text[slot], text, n);
+        cache->len[slot] = (unsigned char)n;
+    }
+}
+
+// Writes the buffer out and empties it; returns 0 on success
+static int out_flush(struct out_buffer *out, FILE *file) {
+    int ok = !out->failed && (out->len == 0 || fwrite(out->data, 1, out->len, file) == out->len);
+    out->len = 0;
+    return ok ? 0 : -1;
+}
+
+static void out_free(struct out_buffer *out) {
+    free(out->data);
+    memset(out, 0, sizeof(*out));
+}
+
+struct shard_job {
+    format_shard format;
+    const void *ctx;
+    struct out_buffer *buffers;
+    size_t first;
+    size_t count;
+    struct time_cache *times;
+};
+
+static void shard_task(void *arg) {
+    struct shard_job *job = arg;
+    for (size_t i = job->first; i < job->first + job->count; i++) {
+        job->buffers[i].times = job->times;
+        job->format(job->ctx, i, &job->buffers[i]);
+    }
+}
+
+/*
+ * Formats num_shards shards as tasks of the pool (only when there is enough
+ * to format to be worth it) and writes them to file in shard order. Returns
+ * 0 on success.
+ */
+static int write_shards(FILE *file, size_t num_shards, size_t rows, format_shard format,
+                        const void *ctx) {
+    size_t num_jobs = rows / SHARD_ROWS;
+    if (num_jobs > (size_t)pool.num_workers * CHUNKS_PER_WORKER) {
+        num_jobs = (size_t)pool.num_workers * CHUNKS_PER_WORKER;
+    }
+    if (num_jobs > num_shards) num_jobs = num_shards;
+    if (num_jobs < 1) num_jobs = 1;
+
+    struct out_buffer *buffers = calloc(num_shards ? num_shards : 1, sizeof(struct out_buffer));
+    struct shard_job *jobs = calloc(num_jobs, sizeof(struct shard_job));
+    struct time_cache *times = calloc(num_jobs, sizeof(struct time_cache));
+    int failed = buffers == NULL || jobs == NULL || times == NULL;
+    if (failed) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+    }
+
+    for (size_t j = 0; !failed && j < num_jobs; j++) {
+        jobs[j].format = format;
+        jobs[j].ctx = ctx;
+        jobs[j].buffers = buffers;
+        jobs[j].first = num_shards * j / num_jobs;
+        jobs[j].count = num_shards * (j + 1) / num_jobs - jobs[j].first;
+        jobs[j].times = &times[j];
+    }
+    struct task_group group = { 0 };
+    for (size_t j = 0; !failed && j < num_jobs; j++) {
+        submit_task(&group, shard_task, &jobs[j]);
+    }
+    wait_group(&group);
+
+    for (size_t i = 0; buffers != NULL && i < num_shards; i++) {
+        failed |= !failed && out_flush(&buffers[i], file) != 0;
+        out_free(&buffers[i]);
+    }
+    free(buffers);
+    free(jobs);
+    free(times);
+    return failed ? -1 : 0;
+}
+
+/*
+ * Time series (--buckets hour|day|month): every used record is also added
+ * to the bucket of its state and UTC hour, day or month. The buckets of a
+ * state form one dense row over the range of bucket numbers that state has
+ * seen; a row widens (at least doubling) when a record falls outside it,
+ * and the rows of other states stay as they are. Only timestamps from 1970
+ * up to SERIES_END are bucketed, which bounds a row to about 1.1 million
+ * hourly buckets however stray its state's timestamps.
+ */
+
+// Days since 1970-01-01 to year, month (1-12) and day, proleptic Gregorian
+static void civil_from_days(int64_t days, int64_t *year, int *month, int *day) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t doe = days - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    *day = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *month = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *year = yoe + era * 400 + (*month <= 2);
+}
+
+// Days since 1970-01-01 of a date (month 1-12), civil_from_days in reverse
+static int64_t days_from_civil(int64_t year, int month, int day) {
+    int64_t y = year - (month <= 2);
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t mp = month > 2 ? month - 3 : month + 9;
+    int64_t doy = (153 * mp + 2) / 5 + day - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+// Bucket number of a time in seconds: hours, days or months since 1970
+static int64_t bucket_of(int64_t seconds) {
+    switch (options.buckets) {
+    case BUCKET_HOUR:
+        return seconds / 3600;
+    case BUCKET_DAY:
+        return seconds / 86400;
+    default: {
+        int64_t year;
+        int month, day;
+        civil_from_days(seconds / 86400, &year, &month, &day);
+        return (year - 1970) * 12 + (month - 1);
+    }
+    }
+}
+
+// The row of state slot, or NULL if it has none
+static const struct time_row *series_row(const struct series *series, int slot) {
+    return (size_t)slot < series->num_rows && series->rows[slot].span > 0 ? &series->rows[slot] : NULL;
+}
+
+// Gives slot a row covering at least buckets [lo, hi); 0 on success
+static int reserve_series(struct series *series, int slot, int64_t lo, int64_t hi) {
+    size_t num_rows = series->num_rows;
+    struct time_row *rows = reserve_array(series->rows, &num_rows, (size_t)slot + 1, sizeof(*rows));
+    if (rows == NULL) {
+        return -1;
+    }
+    memset(rows + series->num_rows, 0, (num_rows - series->num_rows) * sizeof(*rows));
+    series->rows = rows;
+    series->num_rows = num_rows;
+
+    struct time_row *row = &rows[slot];
+    int64_t first = row->first;
+    int64_t end = row->first + (int64_t)row->span;
+    if (row->span == 0) {
+        first = lo;
+        end = hi;
+    } else if (lo < first || hi > end) {
+        int64_t grow = (int64_t)row->span;
+        if (lo < first) first = lo < first - grow ? lo : first - grow;
+        if (hi > end) end = hi > end + grow ? hi : end + grow;
+        if (first < 0) first = 0;
+    } else {
+        return 0;
+    }
+    size_t span = (size_t)(end - first);
+
+    struct time_bucket *buckets = calloc(span, sizeof(struct time_bucket));
+    if (buckets == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    if (row->span > 0) {
+        memcpy(buckets + (row->first - first), row->buckets, row->span * sizeof(struct time_bucket));
+    }
+    free(row->buckets);
+    row->buckets = buckets;
+    row->first = first;
+    row->span = span;
+    return 0;
+}
+
+// Adds a record to the series of the state in slot; 0 on success (also if not bucketed)
+static int add_to_series(struct series *series, int slot, double temperature, double humidity,
+                         double cloudcover, int lightning, int snow,
+                         unsigned long long timestamp) {
+    unsigned long long seconds = timestamp / 1000;
+    if (seconds >= SERIES_END) {
+        return 0;
+    }
+    int64_t bucket = bucket_of((int64_t)seconds);
+    const struct time_row *row = series_row(series, slot);
+    if ((row == NULL || bucket < row->first || bucket >= row->first + (int64_t)row->span) &&
+        reserve_series(series, slot, bucket, bucket + 1) != 0) {
+        return -1;
+    }
+
+    row = &series->rows[slot];
+    struct time_bucket *b = &row->buckets[bucket - row->first];
+    b->num_records++;
+    b->sum_temperature += temperature;
+    b->sum_humidity += humidity;
+    b->sum_cloudcover += cloudcover;
+    b->lightning_strikes += (unsigned long)lightning;
+    b->snow_records += (unsigned long)snow;
+    return 0;
+}
+
+// Adds the row of src_slot in src to the row of dst_slot in dst; 0 on success
+static int merge_series(struct series *dst, int dst_slot, const struct series *src, int src_slot) {
+    const struct time_row *row = series_row(src, src_slot);
+    if (row == NULL) {
+        return 0;
+    }
+    if (reserve_series(dst, dst_slot, row->first, row->first + (int64_t)row->span) != 0) {
+        return -1;
+    }
+    const struct time_bucket *from = row->buckets;
+    struct time_bucket *to = dst->rows[dst_slot].buckets + (row->first - dst->rows[dst_slot].first);
+    for (size_t i = 0; i < row->span; i++) {
+        to[i].num_records += from[i].num_records;
+        to[i].sum_temperature += from[i].sum_temperature;
+        to[i].sum_humidity += from[i].sum_humidity;
+        to[i].sum_cloudcover += from[i].sum_cloudcover;
+        to[i].lightning_strikes += from[i].lightning_strikes;
+        to[i].snow_records += from[i].snow_records;
+    }
+    return 0;
+}
+
+// Makes dst a copy of src; returns 0 on success
+static int copy_series(struct series *dst, const struct series *src) {
+    *dst = *src;
+    dst->rows = src->num_rows ? calloc(src->num_rows, sizeof(*dst->rows)) : NULL;
+    if (src->num_rows && dst->rows == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        memset(dst, 0, sizeof(*dst));
+        return -1;
+    }
+    for (size_t i = 0; i < src->num_rows; i++) {
+        const struct time_row *row = &src->rows[i];
+        if (row->span == 0) {
+            continue;
+        }
+        dst->rows[i].buckets = malloc(row->span * sizeof(struct time_bucket));
+        if (dst->rows[i].buckets == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            free_series(dst);
+            return -1;
+        }
+        memcpy(dst->rows[i].buckets, row->buckets, row->span * sizeof(struct time_bucket));
+        dst->rows[i].first = row->first;
+        dst->rows[i].span = row->span;
+    }
+    return 0;
+}
+
+static void free_series(struct series *series) {
+    for (size_t i = 0; i < series->num_rows; i++) {
+        free(series->rows[i].buckets);
+    }
+    free(series->rows);
+    memset(series, 0, sizeof(*series));
+}
+
+// Start of a bucket in seconds since 1970
+static time_t bucket_start(int64_t bucket) {
+    switch (options.buckets) {
+    case BUCKET_HOUR:
+        return (time_t)(bucket * 3600);
+    case BUCKET_DAY:
+        return (time_t)(bucket * 86400);
+    default:
+        return (time_t)(days_from_civil(1970 + bucket / 12, (int)(bucket % 12) + 1, 1) * 86400);
+    }
+}
+
+/*
+ * Writes the series of the states in report order: CSV with one line per
+ * nonempty bucket, or the binary layout
+ *
+ *      struct series_header
+ *      per state: char code[4], then span struct series_points
+ *
+ * where the span covers the rows of all states and empty buckets have
+ * num_records 0 and NaN averages.
+ */
+int write_series(const struct state_table *table, FILE *out) {
+    const struct series *series = &table->series;
+    if (options.series_format == SERIES_BIN) {
+        int64_t first = 0;
+        int64_t end = 0;
+        for (int i = 0; i < table->num_states; i++) {
+            const struct time_row *row = series_row(series, i);
+            if (row == NULL) {
+                continue;
+            }
+            if (end == first || row->first < first) first = row->first;
+            if (row->first + (int64_t)row->span > end) end = row->first + (int64_t)row->span;
+        }
+
+        struct series_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SERIES_MAGIC, sizeof(header.magic));
+        header.version = SERIES_VERSION;
+        header.unit = (uint32_t)options.buckets;
+        header.num_states = (uint32_t)table->num_states;
+        header.first_start = (int64_t)bucket_start(first);
+        header.first = first;
+        header.span = (uint64_t)(end - first);
+        if (fwrite(&header, sizeof(header), 1, out) != 1) {
+            return -1;
+        }
+        for (int i = 0; i < table->num_states; i++) {
+            char code[4] = { 0 };
+            memcpy(code, table->states[i]->code, sizeof(table->states[i]->code));
+            if (fwrite(code, sizeof(code), 1, out) != 1) {
+                return -1;
+            }
+            const struct time_row *row = series_row(series, i);
+            for (int64_t bucket = first; bucket < end; bucket++) {
+                static const struct time_bucket empty;
+                int inside = row != NULL && bucket >= row->first && bucket < row->first + (int64_t)row->span;
+                const struct time_bucket *b = inside ? &row->buckets[bucket - row->first] : &empty;
+                struct series_point point;
+                double n = b->num_records ? (double)b->num_records : NAN;
+                point.temperature = (b->sum_temperature / n - 273.15) * 9 / 5 + 32;
+                point.humidity = b->sum_humidity / n;
+                point.cloudcover = b->sum_cloudcover / n;
+                point.num_records = b->num_records;
+                point.lightning_strikes = b->lightning_strikes;
+                point.snow_records = b->snow_records;
+                if (fwrite(&point, sizeof(point), 1, out) != 1) {
+                    return -1;
+                }
+            }
+        }
+        return 0;
+    }
+
+    fprintf(out, "state,bucket,records,avg_temperature_f,avg_humidity,avg_cloudcover,"
+                 "lightning_strikes,snow_records\n");
+    size_t rows = 0;
+    for (int i = 0; i < table->num_states; i++) {
+        const struct time_row *row = series_row(series, i);
+        rows += row != NULL ? row->span : 0;
+    }
+    if (write_shards(out, (size_t)table->num_states, rows, format_series_rows, table) != 0) {
+        return -1;
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+// Formats the CSV lines of the nonempty buckets of state slot shard
+static void format_series_rows(const void *ctx, size_t shard, struct out_buffer *out) {
+    const struct state_table *table = ctx;
+    const struct time_row *row = series_row(&table->series, (int)shard);
+    for (size_t j = 0; row != NULL && j < row->span; j++) {
+        const struct time_bucket *b = &row->buckets[j];
+        if (b->num_records == 0) {
+            continue;
+        }
+        // The label, as strftime would give it for the UTC start of the bucket
+        int64_t bucket = row->first + (int64_t)j;
+        int64_t year;
+        int month, day, hour = -1;
+        char label[16];
+        if (options.buckets == BUCKET_MONTH) {
+            year = 1970 + bucket / 12;
+            month = (int)(bucket % 12) + 1;
+            day = 0;
+        } else {
+            int64_t days = options.buckets == BUCKET_HOUR ? bucket / 24 : bucket;
+            hour = options.buckets == BUCKET_HOUR ? (int)(bucket % 24) : -1;
+            civil_from_days(days, &year, &month, &day);
+        }
+        size_t n = (size_t)snprintf(label, sizeof(label), "%04d-", (int)year);
+        out_bytes(out, table->states[shard]->code, strlen(table->states[shard]->code));
+        out_bytes(out, ",", 1);
+        out_bytes(out, label, n);
+        out_two(label, month);
+        n = 2;
+        if (day > 0) {
+            label[n++] = '-';
+            out_two(label + n, day);
+            n += 2;
+        }
+        if (hour >= 0) {
+            memcpy(label + n, "T", 1);
+            out_two(label + n + 1, hour);
+            memcpy(label + n + 3, ":00", 3);
+            n += 6;
+        }
+        label[n++] = ',';
+        out_bytes(out, label, n);
+
+        double count = (double)b->num_records;
+        out_ulong(out, b->num_records);
+        out_bytes(out, ",", 1);
+        out_fixed(out, (b->sum_temperature / count - 273.15) * 9 / 5 + 32, 2);
+        out_bytes(out, ",", 1);
+        out_fixed(out, b->sum_humidity / count, 2);
+        out_bytes(out, ",", 1);
+        out_fixed(out, b->sum_cloudcover / count, 2);
+        out_bytes(out, ",", 1);
+        out_ulong(out, b->lightning_strikes);
+        out_bytes(out, ",", 1);
+        out_ulong(out, b->snow_records);
+        out_bytes(out, "\n", 1);
+    }
+}
+
+/*
+ * Quantiles (--quantiles): every used record also counts into fixed-bin
+ * histograms of its state's temperature and humidity. The bins are centred
+ * on multiples of their width (0.1 K, 0.1 %), so the one-decimal values of
+ * the NOAA dumps fall on a bin centre and come out exactly; other values are
+ * off by at most half a bin. Temperatures outside the Kelvin range of
+ * TEMP_BIN_MIN to TEMP_BIN_MAX count into the end bins. Merging is a sum of
+ * bin counts, so threads and files combine like the other aggregates.
+ */
+
+static size_t sketch_bin(double value, double low, size_t bins) {
+    double bin = (value - low) * 10.0 + 0.5;  // Truncated below: the nearest centre
+    if (!(bin >= 1.0)) return 0;  // Also catches NaN
+    return bin >= (double)(bins - 1) ? bins - 1 : (size_t)bin;
+}
+
+// Counts one record into the sketch of its state slot; returns 0 on success
+static int add_to_sketch(struct state_table *table, int slot, double temperature, double humidity) {
+    struct sketch *sketch = table->sketches[slot];
+    if (sketch == NULL &&
+        (sketch = table->sketches[slot] = arena_alloc(&table->arena, sizeof(struct sketch))) == NULL) {
+        return -1;
+    }
+    sketch->temperature[sketch_bin(temperature, TEMP_BIN_MIN, TEMP_BINS)]++;
+    sketch->humidity[sketch_bin(humidity, 0.0, HUMIDITY_BINS)]++;
+    return 0;
+}
+
+// Adds the sketch of src's slot src_slot to dst's slot dst_slot; returns 0 on success
+static int merge_sketch(struct state_table *dst, int dst_slot, const struct state_table *src,
+                        int src_slot) {
+    const struct sketch *from = src->sketches[src_slot];
+    if (from == NULL) {
+        return 0;
+    }
+    struct sketch *sketch = dst->sketches[dst_slot];
+    if (sketch == NULL &&
+        (sketch = dst->sketches[dst_slot] = arena_alloc(&dst->arena, sizeof(struct sketch))) == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < TEMP_BINS; i++) {
+        sketch->temperature[i] += from->temperature[i];
+    }
+    for (size_t i = 0; i < HUMIDITY_BINS; i++) {
+        sketch->humidity[i] += from->humidity[i];
+    }
+    return 0;
+}
+
+/*
+ * The q-quantile by nearest rank: the centre of the bin that holds the
+ * ceil(q * total)-th smallest value.
+ */
+static double quantile_of(const uint64_t *bins, size_t num_bins, uint64_t total, double low,
+                          double q) {
+    double exact = q * (double)total;
+    uint64_t rank = (uint64_t)exact;
+    uint64_t seen = 0;
+    size_t i = 0;
+    if ((double)rank < exact || rank == 0) rank++;
+    while (i + 1 < num_bins && (seen += bins[i]) < rank) {
+        i++;
+    }
+    return low + (double)i / 10.0;
+}
+
+// Prints p50, p95 and p99 of temperature and humidity per state after the report
+void print_quantiles(const struct state_table *table) {
+    static const double levels[] = { 0.50, 0.95, 0.99 };
+    static const char *const names[] = { "p50", "p95", "p99" };
+    for (int i = 0; i < table->num_states; i++) {
+        const struct climate_info *info = table->states[i];
+        const struct sketch *sketch = table->sketches[i];
+        if (sketch == NULL) {
+            continue;
+        }
+        printf("-- Quantiles: %s --\n", info->code);
+        printf("Temperature");
+        for (int j = 0; j < 3; j++) {
+            double kelvin = quantile_of(sketch->temperature, TEMP_BINS, info->num_records,
+                                        TEMP_BIN_MIN, levels[j]);
+            // The end bins also hold everything beyond them; the extremes are exact
+            if (kelvin > info->max_temp) kelvin = info->max_temp;
+            if (kelvin < info->min_temp) kelvin = info->min_temp;
+            printf(" %s: %.1fF", names[j], (kelvin - 273.15) * 9 / 5 + 32);
+        }
+        printf("\nHumidity");
+        for (int j = 0; j < 3; j++) {
+            printf(" %s: %.1f%%", names[j],
+                   quantile_of(sketch->humidity, HUMIDITY_BINS, info->num_records, 0.0, levels[j]));
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * Folds the table src into dst. src must cover data that comes after dst's in
+ * file order: new states are appended in src's first-seen order, and on equal
+ * max/min temperatures the earlier (dst) time is kept, as in a serial pass.
+ * Returns the number of records merged, or -1 on error.
+ */
+long merge_states(struct state_table *dst, struct state_table *src) {
+    long merged = 0;
+    add_stats(&dst->stats, &src->stats);
+    for (int i = 0; i < src->num_states; i++) {
+        struct climate_info *from = src->states[i];
+
+        int j = find_state(dst, from->code);
+        if (j < 0) {
+            return -1;
+        }
+
+        merge_info(dst->states[j], from);
+        if (merge_series(&dst->series, j, &src->series, i) != 0 ||
+            (options.quantiles && merge_sketch(dst, j, src, i) != 0) ||
+            (options.sample > 0 && merge_sample(dst, j, src, i) != 0)) {
+            return -1;
+        }
+        merged += (long)from->num_records;
+    }
+    if (merge_cells(&dst->geo, &dst->arena, &src->geo) != 0) {
+        return -1;
+    }
+    return merged;
+}
+
+// Folds the aggregates of from, which come after info's in file order, into info
+static void merge_info(struct climate_info *info, const struct climate_info *from) {
+    info->num_records += from->num_records;
+    neumaier_add(&info->sum_temperature, &info->temperature_error, from->sum_temperature);
+    info->temperature_error += from->temperature_error;
+    neumaier_add(&info->sum_humidity, &info->humidity_error, from->sum_humidity);
+    info->humidity_error += from->humidity_error;
+    neumaier_add(&info->sum_cloudcover, &info->cloudcover_error, from->sum_cloudcover);
+    info->cloudcover_error += from->cloudcover_error;
+    add_count(&info->lightning_strikes, &info->lightning_high, lightning_count(from));
+    add_count(&info->snow_records, &info->snow_high, snow_count(from));
+    info->sum_pressure += from->sum_pressure;
+    info->sum_dew_point += from->sum_dew_point;
+    info->sum_heat_index += from->sum_heat_index;
+    info->dew_point_records += from->dew_point_records;
+
+    if (from->max_temp > info->max_temp) {
+        info->max_temp = from->max_temp;
+        info->max_temp_time = from->max_temp_time;
+    }
+    if (from->min_temp < info->min_temp) {
+        info->min_temp = from->min_temp;
+        info->min_temp_time = from->min_temp_time;
+    }
+}
+
+void add_stats(struct scan_stats *dst, const struct scan_stats *src) {
+    dst->bytes += src->bytes;
+    dst->lines += src->lines;
+    dst->used += src->used;
+    for (int i = 0; i < NUM_SKIPS; i++) {
+        dst->skipped[i] += src->skipped[i];
+    }
+    for (int i = 0; i < NUM_STAGES; i++) {
+        dst->ticks[i] += src->ticks[i];
+    }
+}
+
+static double tick_ns = 1.0;  // Nanoseconds per stage_clock() tick
+
+/*
+ * Stage timestamps for --stats: the time stamp counter where there is one
+ * (a few cycles to read), else the monotonic clock in nanoseconds. Always 0
+ * without --stats, so the counters cost next to nothing then.
+ */
+static uint64_t stage_clock(void) {
+    if (!options.stats) {
+        return 0;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Derives tick_ns from the ticks and monotonic seconds of the same interval
+static void calibrate_ticks(uint64_t start, uint64_t end, double seconds) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (end > start && seconds > 0) {
+        tick_ns = seconds * 1e9 / (double)(end - start);
+    }
+#else
+    (void)start;
+    (void)end;
+    (void)seconds;
+#endif
+}
+
+// Sum of all stage ticks so far
+static uint64_t staged_ticks(const struct scan_stats *stats) {
+    uint64_t total = 0;
+    for (int i = 0; i < NUM_STAGES; i++) {
+        total += stats->ticks[i];
+    }
+    return total;
+}
+
+/*
+ * Charges the part of a scan that started at start (with staged ticks
+ * already counted) and that no per-line stage took to STAGE_READ.
+ */
+static void charge_read(struct scan_stats *stats, uint64_t start, uint64_t staged) {
+    stats->ticks[STAGE_READ] += (stage_clock() - start) - (staged_ticks(stats) - staged);
+}
+
+/*
+ * Prints the --stats summary to stderr. Stage times are added up over all
+ * threads, so with several threads they can exceed the wall time.
+ */
+void print_stats(const struct scan_stats *stats, double seconds) {
+    static const char *const skip_names[NUM_SKIPS] = {
+        "too_long", "malformed", "out_of_range", "filtered"
+    };
+    static const char *const skip_labels[NUM_SKIPS] = {
+        "too long", "malformed", "out of range", "filtered out"
+    };
+    static const char *const stage_names[NUM_STAGES] = {
+        "read", "parse", "validate", "lookup", "aggregate"
+    };
+
+    if (options.stats == STATS_JSON) {
+        fprintf(stderr, "{\"bytes\": %llu, \"lines\": %llu, \"used\": %llu, \"skipped\": {",
+                (unsigned long long)stats->bytes, (unsigned long long)stats->lines,
+                (unsigned long long)stats->used);
+        for (int i = 0; i < NUM_SKIPS; i++) {
+            fprintf(stderr, "%s\"%s\": %llu", i ? ", " : "", skip_names[i],
+                    (unsigned long long)stats->skipped[i]);
+        }
+        fprintf(stderr, "}, \"stage_ns\": {");
+        for (int i = 0; i < NUM_STAGES; i++) {
+            fprintf(stderr, "%s\"%s\": %.0f", i ? ", " : "", stage_names[i],
+                    (double)stats->ticks[i] * tick_ns);
+        }
+        fprintf(stderr, "}, \"wall_ns\": %.0f, \"threads\": %d}\n", seconds * 1e9,
+                options.num_threads);
+        return;
+    }
+
+    fprintf(stderr, "Bytes read: %llu\n", (unsigned long long)stats->bytes);
+    fprintf(stderr, "Lines seen: %llu\n", (unsigned long long)stats->lines);
+    fprintf(stderr, "Lines used: %llu\n", (unsigned long long)stats->used);
+    for (int i = 0; i < NUM_SKIPS; i++) {
+        fprintf(stderr, "Lines skipped, %s: %llu\n", skip_labels[i],
+                (unsigned long long)stats->skipped[i]);
+    }
+    for (int i = 0; i < NUM_STAGES; i++) {
+        fprintf(stderr, "Time in %s: %.3f ms\n", stage_names[i],
+                (double)stats->ticks[i] * tick_ns / 1e6);
+    }
+    fprintf(stderr, "Wall time: %.3f ms\n", seconds * 1e3);
+    fprintf(stderr, "Threads: %d\n", options.num_threads);
+}
+
+// Makes dst (empty) a deep copy of src; returns 0 on success
+int copy_states(struct state_table *dst, const struct state_table *src) {
+    memset(dst, 0, sizeof(*dst));
+    dst->stats = src->stats;
+    if (copy_series(&dst->series, &src->series) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < src->num_states; i++) {
+        // Added in the same order, so the copy of slot i gets slot i
+        if (find_state(dst, src->states[i]->code) != i) {
+            free_states(dst);
+            return -1;
+        }
+        *dst->states[i] = *src->states[i];
+        if ((options.quantiles && merge_sketch(dst, i, src, i) != 0) ||
+            (options.sample > 0 && merge_sample(dst, i, src, i) != 0)) {
+            free_states(dst);
+            return -1;
+        }
+    }
+    if (copy_cells(&dst->geo, &dst->arena, &src->geo) != 0) {
+        free_states(dst);
+        return -1;
+    }
+    return 0;
+}
+
+// Releases everything the table owns in one go and leaves it empty
+void free_states(struct state_table *table) {
+    free(table->states);
+    free(table->sketches);
+    free(table->samples);
+    free_keys(&table->index);
+    free_cells(&table->geo);
+    free_series(&table->series);
+    release_arena(&table->arena);
+    memset(table, 0, sizeof(*table));
+}
+
+/*
+ * Bump allocation for aggregate nodes. Nodes are rounded up to whole cache
+ * lines and carved out of ARENA_ALIGN-aligned blocks; nothing is freed on
+ * its own, release_arena gives all blocks back at once. Every thread's table
+ * has its own arena, so ingest takes no allocator lock for new nodes once
+ * the first block is there. Returns zeroed memory, or NULL after reporting
+ * the failure.
+ */
+static void *arena_alloc(struct arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    if (size > arena->left) {
+        size_t block_size = size + ARENA_ALIGN > ARENA_BLOCK_SIZE ? size + ARENA_ALIGN : ARENA_BLOCK_SIZE;
+        void *memory;
+        if (posix_memalign(&memory, ARENA_ALIGN, block_size) != 0) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return NULL;
+        }
+        struct arena_block *block = memory;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->next = (char *)memory + ARENA_ALIGN;  // The header keeps a line of its own
+        arena->left = block_size - ARENA_ALIGN;
+    }
+    void *node = arena->next;
+    arena->next += size;
+    arena->left -= size;
+    memset(node, 0, size);
+    return node;
+}
+
+static void release_arena(struct arena *arena) {
+    while (arena->blocks != NULL) {
+        struct arena_block *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    memset(arena, 0, sizeof(*arena));
+}
+
+/*
+ * Key indexes (struct key_index). A lookup is a multiply, usually a single
+ * probe and one compare of the key; positions never move, since keys[] is
+ * only appended to and growing just rehashes the positions.
+ */
+
+static size_t key_hash(const struct key_index *index, uint64_t key) {
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (index->capacity - 1);
+}
+
+// Position of key in index, or -1 if it is not there
+static long key_find(const struct key_index *index, uint64_t key) {
+    if (index->capacity == 0) {
+        return -1;
+    }
+    for (size_t i = key_hash(index, key); ; i = (i + 1) & (index->capacity - 1)) {
+        const struct key_slot *slot = &index->slots[i];
+        if (slot->key == key) {
+            return (long)slot->position;
+        }
+        if (slot->key == 0) {
+            return -1;
+        }
+    }
+}
+
+// Position of key, which is added at the end if it is new; -1 if allocation failed
+static long key_insert(struct key_index *index, uint64_t key) {
+    long found = key_find(index, key);
+    if (found >= 0) {
+        return found;
+    }
+    if (index->count == index->reserved) {
+        size_t reserved = index->reserved ? index->reserved * 2 : KEY_INITIAL_SLOTS / 2;
+        uint64_t *keys = realloc(index->keys, reserved * sizeof(uint64_t));
+        if (keys == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return -1;
+        }
+        index->keys = keys;
+        index->reserved = reserved;
+    }
+    if ((index->count + 1) * 10 > index->capacity * 7) {
+        size_t capacity = index->capacity ? index->capacity * 2 : KEY_INITIAL_SLOTS;
+        struct key_slot *slots = calloc(capacity, sizeof(struct key_slot));
+        if (slots == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return -1;
+        }
+        free(index->slots);
+        index->slots = slots;
+        index->capacity = capacity;
+        for (size_t p = 0; p < index->count; p++) {
+            size_t i = key_hash(index, index->keys[p]);
+            while (slots[i].key != 0) {
+                i = (i + 1) & (capacity - 1);
+            }
+            slots[i].key = index->keys[p];
+            slots[i].position = (uint32_t)p;
+        }
+    }
+    size_t i = key_hash(index, key);
+    while (index->slots[i].key != 0) {
+        i = (i + 1) & (index->capacity - 1);
+    }
+    index->slots[i].key = key;
+    index->slots[i].position = (uint32_t)index->count;
+    index->keys[index->count] = key;
+    return (long)index->count++;
+}
+
+static void free_keys(struct key_index *index) {
+    free(index->keys);
+    free(index->slots);
+    memset(index, 0, sizeof(*index));
+}
+
+/*
+ * Makes room for at least needed elements of size bytes in array, which has
+ * room for *reserved, zeroing the new ones. Returns the array (which may
+ * have moved), or NULL after reporting the failure; array stays valid then.
+ */
+static void *reserve_array(void *array, size_t *reserved, size_t needed, size_t size) {
+    if (needed <= *reserved && array != NULL) {
+        return array;
+    }
+    size_t count = *reserved ? *reserved * 2 : STATES_INITIAL;
+    if (count < needed) count = needed;
+    char *grown = realloc(array, count * size);
+    if (grown == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+    memset(grown + *reserved * size, 0, (count - *reserved) * size);
+    *reserved = count;
+    return grown;
+}
+
+// Index key of a state code of up to two characters; never 0
+static uint64_t code_key(const char *code) {
+    return 1u << 16 | state_key(code[0], code[0] != '\0' ? code[1] : '\0');
+}
+
+// Returns the slot of the state with the given code, or -1 if it has not been seen
+static int seen_state(const struct state_table *table, const char *code) {
+    return (int)key_find(&table->index, code_key(code));
+}
+
+/*
+ * Returns the slot of the state with the given code, creating it on first
+ * sight; -1 if allocation failed.
+ */
+int find_state(struct state_table *table, const char *code) {
+    int seen = seen_state(table, code);
+    if (seen >= 0) {
+        return seen;
+    }
+
+    size_t max_states = (size_t)table->max_states;
+    struct climate_info **states = reserve_array(table->states, &max_states,
+                                                 (size_t)table->num_states + 1, sizeof(*states));
+    if (states == NULL) {
+        return -1;
+    }
+    table->states = states;
+    max_states = (size_t)table->max_states;
+    struct sketch **sketches = reserve_array(table->sketches, &max_states,
+                                             (size_t)table->num_states + 1, sizeof(*sketches));
+    if (sketches == NULL) {
+        return -1;
+    }
+    table->sketches = sketches;
+    max_states = (size_t)table->max_states;
+    struct sample_counts **samples = reserve_array(table->samples, &max_states,
+                                                   (size_t)table->num_states + 1, sizeof(*samples));
+    if (samples == NULL) {
+        return -1;
+    }
+    table->samples = samples;
+    table->max_states = (int)max_states;
+
+    struct climate_info *info = arena_alloc(&table->arena, sizeof(struct climate_info));
+    if (info == NULL || key_insert(&table->index, code_key(code)) < 0) {
+        return -1;
+    }
+    strncpy(info->code, code, 2);
+    info->code[2] = '\0';
+    info->max_temp = -DBL_MAX;
+    info->min_temp = DBL_MAX;
+
+    int slot = table->num_states++;
+    table->states[slot] = info;
+    return slot;
+}
+
+/*
+ * Geohash cells (-g N): records are also rolled up per geohash prefix of N
+ * characters. A prefix packs into 5 bits per character below a leading 1
+ * bit, so every key is nonzero and fits a uint64_t; the cells are found
+ * through a key_index, like the states.
+ */
+
+static const char geohash_alphabet[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+static signed char geohash_values[256];  // Alphabet position, or -1 (see init_geohash)
+
+static void init_geohash(void) {
+    memset(geohash_values, -1, sizeof(geohash_values));
+    for (int i = 0; i < 32; i++) {
+        geohash_values[(unsigned char)geohash_alphabet[i]] = (signed char)i;
+    }
+}
+
+// Key of the cell holding geohash at options.geohash precision; 0 if it has no such prefix
+static uint64_t geo_key(const char *geohash) {
+    uint64_t key = 1;
+    for (int i = 0; i < options.geohash; i++) {
+        int value = geohash_values[(unsigned char)geohash[i]];
+        if (value < 0) {
+            return 0;  // Too short (stops at the '\0') or not a geohash character
+        }
+        key = key << 5 | (uint64_t)value;
+    }
+    return key;
+}
+
+// Writes the prefix of a cell key into out (options.geohash + 1 bytes)
+static void geo_prefix(uint64_t key, char *out) {
+    for (int i = options.geohash - 1; i >= 0; i--) {
+        out[i] = geohash_alphabet[key & 31];
+        key >>= 5;
+    }
+    out[options.geohash] = '\0';
+}
+
+/*
+ * Returns the cell for a (nonzero) key, creating it in arena on first sight;
+ * NULL if allocation failed.
+ */
+struct climate_info *find_cell(struct geo_table *geo, struct arena *arena, uint64_t key) {
+    long pos = key_find(&geo->index, key);
+    if (pos >= 0) {
+        return geo->cells[pos];
+    }
+    struct climate_info **cells = reserve_array(geo->cells, &geo->reserved, geo->index.count + 1,
+                                                sizeof(*cells));
+    if (cells == NULL) {
+        return NULL;
+    }
+    geo->cells = cells;
+    struct climate_info *info = arena_alloc(arena, sizeof(struct climate_info));
+    if (info == NULL || (pos = key_insert(&geo->index, key)) < 0) {
+        return NULL;
+    }
+    info->max_temp = -DBL_MAX;
+    info->min_temp = DBL_MAX;
+    geo->cells[pos] = info;
+    return info;
+}
+
+// Folds the cells of src into dst, which covers the data before src's; 0 on success
+static int merge_cells(struct geo_table *dst, struct arena *arena, const struct geo_table *src) {
+    for (size_t i = 0; i < src->index.count; i++) {
+        struct climate_info *info = find_cell(dst, arena, src->index.keys[i]);
+        if (info == NULL) {
+            return -1;
+        }
+        merge_info(info, src->cells[i]);
+    }
+    return 0;
+}
+
+// Makes dst a copy of src with its cells in arena; returns 0 on success
+static int copy_cells(struct geo_table *dst, struct arena *arena, const struct geo_table *src) {
+    memset(dst, 0, sizeof(*dst));
+    for (size_t i = 0; i < src->index.count; i++) {
+        struct climate_info *info = find_cell(dst, arena, src->index.keys[i]);
+        if (info == NULL) {
+            return -1;
+        }
+        *info = *src->cells[i];
+    }
+    return 0;
+}
+
+static void free_cells(struct geo_table *geo) {
+    free_keys(&geo->index);
+    free(geo->cells);
+    memset(geo, 0, sizeof(*geo));
+}
+
+static long double cell_average_temp(const struct climate_info *info) {
+    return temperature_total(info) / info->num_records;
+}
+
+/*
+ * Ranking of two cells for a top list: > 0 if a comes first. CELL_HOTTEST
+ * and CELL_COLDEST go by average temperature, CELL_STORMIEST by lightning
+ * strikes; ties go to the smaller key so the lists do not depend on the
+ * thread count.
+ */
+static int rank_cells(int order, const struct climate_info *a, uint64_t key_a,
+                      const struct climate_info *b, uint64_t key_b) {
+    int cmp = 0;
+    if (order == CELL_STORMIEST) {
+        unsigned long la = lightning_count(a);
+        unsigned long lb = lightning_count(b);
+        cmp = (la > lb) - (la < lb);
+    } else {
+        long double ta = cell_average_temp(a);
+        long double tb = cell_average_temp(b);
+        cmp = (ta > tb) - (ta < tb);
+        if (order == CELL_COLDEST) {
+            cmp = -cmp;
+        }
+    }
+    return cmp != 0 ? cmp : (key_a < key_b) - (key_a > key_b);
+}
+
+// Prints the top cells of one order, keeping a sorted list of at most top slots
+static void print_top_cells(const struct geo_table *geo, int order, size_t *best, size_t top) {
+    static const char *const titles[] = { "Hottest", "Coldest", "Stormiest" };
+    const uint64_t *keys = geo->index.keys;
+    size_t count = 0;
+    for (size_t i = 0; i < geo->index.count; i++) {
+        size_t pos = count < top ? count++ : top;
+        while (pos > 0 && rank_cells(order, geo->cells[i], keys[i],
+                                     geo->cells[best[pos - 1]], keys[best[pos - 1]]) > 0) {
+            if (pos < top) best[pos] = best[pos - 1];
+            pos--;
+        }
+        if (pos < top) best[pos] = i;
+    }
+
+    printf("-- %s %zu cells --\n", titles[order], count);
+    for (size_t i = 0; i < count; i++) {
+        const struct climate_info *info = geo->cells[best[i]];
+        char prefix[GEOHASH_MAX + 1];
+        geo_prefix(keys[best[i]], prefix);
+        if (order == CELL_STORMIEST) {
+            printf("%s: %lu lightning strikes in %lu records\n", prefix,
+                   lightning_count(info), info->num_records);
+        } else {
+            printf("%s: %.1LfF average over %lu records\n", prefix,
+                   (cell_average_temp(info) - 273.15) * 9/5 + 32, info->num_records);
+        }
+    }
+}
+
+// Prints the geohash cell rollup after the state report
+void print_cells(const struct geo_table *geo) {
+    printf("Geohash cells (precision %d): %zu\n", options.geohash, geo->index.count);
+    size_t *best = malloc(sizeof(size_t) * (size_t)options.top_cells);
+    if (best == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return;
+    }
+    for (int order = CELL_HOTTEST; order <= CELL_STORMIEST; order++) {
+        print_top_cells(geo, order, best, (size_t)options.top_cells);
+    }
+    free(best);
+}
+
+/*
+ * Hand-written tokenizer for the nine-field TDV record.
+ *
+ * The fast path only accepts the canonical layout the NOAA dumps use:
+ * single tabs between fields, a two character state code, a plain decimal
+ * timestamp, a geohash of at most 12 characters and values of the form
+ * [-]digits[.digits]. Anything else is handed to the original sscanf call,
+ * so the set of accepted lines and the parsed values are exactly the same
+ * as before.
+ */
+
+// Powers of ten that are exactly representable as doubles
+static const double exact_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+    1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+    1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Same set of characters isspace() matches in the C locale, plus the terminator
+static int is_field_end(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r') || c == '\0';
+}
+
+static int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+/*
+ * Converts [-]digits[.digits] starting at p. When the mantissa fits in 53
+ * bits and there are at most 22 fraction digits, one IEEE division by an
+ * exact power of ten gives the correctly rounded result, which is what
+ * strtod returns. Returns a pointer past the number, or NULL when the
+ * caller has to fall back to sscanf.
+ */
+static const char *parse_decimal(const char *p, const char *end, double *out) {
+#if FLT_EVAL_METHOD == 0
+    int negative = 0;
+    if (p < end && *p == '-') {
+        negative = 1;
+        p++;
+    }
+
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int frac_digits = 0;
+    while (p < end && is_digit(*p)) {
+        if (mantissa > (1ULL << 53) / 10) return NULL;
+        mantissa = mantissa * 10 + (unsigned long long)(*p - '0');
+        digits++;
+        p++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && is_digit(*p)) {
+            if (mantissa > (1ULL << 53) / 10 || frac_digits == 22) return NULL;
+            mantissa = mantissa * 10 + (unsigned long long)(*p - '0');
+            digits++;
+            frac_digits++;
+            p++;
+        }
+    }
+    if (digits == 0 || mantissa > (1ULL << 53)) return NULL;
+
+    // Exponents, hex floats, inf/nan and the like are left to strtod
+    if (p < end && !is_field_end(*p)) return NULL;
+
+    double value = (double)mantissa / exact_pow10[frac_digits];
+    *out = negative ? -value : value;
+    return p;
+#else
+    // Extended precision evaluation would double-round the division
+    (void)p;
+    (void)end;
+    (void)out;
+    return NULL;
+#endif
+}
+
+// Copies a token of at most max_len characters that must be followed by a tab
+static const char *parse_token(const char *p, const char *end, char *out, int max_len) {
+    int n = 0;
+    while (p < end && !is_field_end(*p)) {
+        if (n == max_len) return NULL;
+        out[n++] = *p++;
+    }
+    if (n == 0 || p == end || *p != '\t') return NULL;
+    out[n] = '\0';
+    return p;
+}
+
+static int parse_record_fast(const char *p, const char *end, struct tdv_record *rec) {
+    if (end - p < 3 || is_field_end(p[0]) || is_field_end(p[1]) || p[2] != '\t') {
+        return -1;
+    }
+    rec->state_code[0] = p[0];
+    rec->state_code[1] = p[1];
+    rec->state_code[2] = '\0';
+    p += 3;
+
+    unsigned long long timestamp = 0;
+    int digits = 0;
+    while (p < end && is_digit(*p)) {
+        if (++digits > 19) return -1;
+        timestamp = timestamp * 10 + (unsigned long long)(*p++ - '0');
+    }
+    if (digits == 0 || p == end || *p != '\t') return -1;
+    rec->timestamp = timestamp;
+    p++;
+
+    if ((p = parse_token(p, end, rec->geohash, 12)) == NULL) return -1;
+    p++;
+
+    double *values[] = { &rec->humidity, &rec->snow, &rec->cloudcover,
+                         &rec->lightning, &rec->pressure, &rec->temperature };
+    for (int i = 0; i < 6; i++) {
+        if ((p = parse_decimal(p, end, values[i])) == NULL) return -1;
+        if (i < 5) {
+            if (p == end || *p != '\t') return -1;
+            p++;
+        }
+    }
+    return 0;
+}
+
+// Parses one line (without needing a terminating '\0'); returns 0 on success
+int parse_record(const char *line, size_t len, struct tdv_record *rec) {
+    if (parse_record_fast(line, line + len, rec) == 0) {
+        return 0;
+    }
+
+    // Non-canonical line: let sscanf decide, exactly as before
+    char local[PARSE_BUFFER];
+    char *buffer = len < PARSE_BUFFER ? local : malloc(len + 1);
+    if (buffer == NULL) {
+        return -1;
+    }
+    memcpy(buffer, line, len);
+    buffer[len] = '\0';
+    int fields = sscanf(buffer, "%2s\t%llu\t%12s\t%lf\t%lf\t%lf\t%lf\t%lf\t%lf",
+            rec->state_code, &rec->timestamp, rec->geohash, &rec->humidity, &rec->snow,
+            &rec->cloudcover, &rec->lightning, &rec->pressure, &rec->temperature);
+    if (buffer != local) {
+        free(buffer);
+    }
+    return fields == 9 ? 0 : -1;
+}
+
+// method to print the summary for each state
+void print_report(struct climate_info *states[], int num_states) {
+    report_states(states, NULL, num_states);
+}
+
+// What format_state reads: the states and, for --sample, their samples by slot (or NULL)
+struct report_view {
+    struct climate_info *const *states;
+    struct sample_counts *const *samples;
+};
+
+// print_report where the counts of states with a sample are given as estimates (see analyze_sampled)
+static void report_states(struct climate_info *states[], struct sample_counts *samples[],
+                          int num_states) {
+    struct out_buffer out = { NULL, 0, 0, 0, NULL };
+    out_str(&out, "States found: ");  // Changed to avoid extra newline
+    for (int i = 0; i < num_states; ++i) {
+        if (states[i] != NULL) {
+            out_str(&out, states[i]->code);
+            out_bytes(&out, " ", 1);
+        }
+    }
+    out_bytes(&out, "\n", 1);
+    out_flush(&out, stdout);
+    out_free(&out);
+
+    struct report_view view = { states, samples };
+    write_shards(stdout, (size_t)num_states, (size_t)num_states * 12, format_state, &view);
+}
+
+// Square root for the confidence intervals: Newton steps from a halved exponent, within 6%
+static double sample_sqrt(double y) {
+    if (!(y > 0)) {
+        return 0;
+    }
+    uint64_t bits;
+    memcpy(&bits, &y, sizeof(bits));
+    bits = (bits >> 1) + (UINT64_C(1023) << 51);
+    double x;
+    memcpy(&x, &bits, sizeof(x));
+    for (int i = 0; i < 6; i++) {
+        x = 0.5 * (x + y / x);
+    }
+    return x;
+}
+
+/*
+ * A count, or with a sample its estimate and 95% confidence interval:
+ * "~N (95% CI LOW to HIGH)". The interval does not reach below the records
+ * actually seen.
+ */
+static void out_count(struct out_buffer *out, unsigned long count,
+                      const struct sample_counts *sample, int which) {
+    if (sample == NULL) {
+        out_ulong(out, count);
+        return;
+    }
+    double estimate = (double)count + sample->unread[which];
+    double margin = SAMPLE_Z * sample_sqrt(sample->variance[which]);
+    double low = estimate - margin > (double)count ? estimate - margin : (double)count;
+    out_str(out, "~");
+    out_ulong(out, (unsigned long)(estimate + 0.5));
+    out_str(out, " (95% CI ");
+    out_ulong(out, (unsigned long)(low + 0.5));
+    out_str(out, " to ");
+    out_ulong(out, (unsigned long)(estimate + margin + 0.5));
+    out_str(out, ")");
+}
+
+// Formats the report block of states[shard]
+static void format_state(const void *ctx, size_t shard, struct out_buffer *out) {
+    const struct report_view *view = ctx;
+    const struct climate_info *info = view->states[shard];
+    if (info == NULL) return;
+    const struct sample_counts *sample = view->samples != NULL ? view->samples[shard] : NULL;
+
+    out_str(out, "-- State: ");
+    out_str(out, info->code);
+    out_str(out, " --\nNumber of Records: ");
+    out_count(out, info->num_records, sample, SAMPLE_RECORDS);
+    out_str(out, "\nAverage Humidity: ");
+    out_fixed(out, humidity_total(info) / info->num_records, 1);
+    out_str(out, "%\nAverage Temperature: ");
+    out_fixed(out, (temperature_total(info) / info->num_records - 273.15) * 9/5 + 32, 1);
+    out_str(out, "F\nMax Temperature: ");
+    out_fixed(out, ((long double)info->max_temp - 273.15) * 9/5 + 32, 1);
+    out_str(out, "F\nMax Temperature on: ");
+    out_ctime(out, info->max_temp_time);
+    out_str(out, "Min Temperature: ");
+    out_fixed(out, ((long double)info->min_temp - 273.15) * 9/5 + 32, 1);
+    out_str(out, "F\nMin Temperature on: ");
+    out_ctime(out, info->min_temp_time);
+    out_str(out, "Lightning Strikes: ");
+    out_count(out, lightning_count(info), sample, SAMPLE_LIGHTNING);
+    out_str(out, "\nRecords with Snow Cover: ");
+    out_count(out, snow_count(info), sample, SAMPLE_SNOW);
+    out_str(out, "\nAverage Cloud Cover: ");
+    out_fixed(out, cloudcover_total(info) / info->num_records, 1);
+    out_str(out, "%\n");
+    if (options.metrics & METRIC_PRESSURE) {
+        out_str(out, "Average Pressure: ");
+        out_fixed(out, (long double)info->sum_pressure / info->num_records, 1);
+        out_str(out, " Pa\n");
+    }
+    if (options.metrics & METRIC_DEW_POINT) {
+        out_str(out, "Average Dew Point: ");
+        out_fixed(out, ((long double)info->sum_dew_point / info->dew_point_records - 273.15) * 9/5 + 32, 1);
+        out_str(out, "F\n");
+    }
+    if (options.metrics & METRIC_HEAT_INDEX) {
+        out_str(out, "Average Heat Index: ");
+        out_fixed(out, ((long double)info->sum_heat_index / info->num_records - 273.15) * 9/5 + 32, 1);
+        out_str(out, "F\n");
+    }
+}
+
+// A state code as a JSON string, or as a CSV field (quoted only where needed)
+static void out_code(struct out_buffer *out, const char *code, int json) {
+    int quote = json || strpbrk(code, ",\"\r") != NULL;
+    out_str(out, quote ? "\"" : "");
+    for (const char *c = code; *c != '\0'; c++) {
+        if (json && (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20)) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char)*c);
+            out_str(out, escape);
+        } else {
+            out_bytes(out, c, 1);
+            if (*c == '"') {
+                out_bytes(out, c, 1);  // CSV doubles a quote
+            }
+        }
+    }
+    out_str(out, quote ? "\"" : "");
+}
+
+/*
+ * Writes the aggregates of the states in report order as options.format:
+ *
+ *      json    {"states": [{"state": "TN", "records": 17097, ...}, ...]}
+ *      csv     a header line, then one line per state
+ *      bin     struct aggregate_header, then a state_record per state
+ *
+ * JSON and CSV carry the report's values (Fahrenheit and percent, times as
+ * seconds since 1970) followed by the raw aggregates: the temperature sum in
+ * Kelvin with its compensation term, the humidity and cloud cover sums and
+ * the extremes in Kelvin. The --metrics selected add their averages and
+ * sums (pressure in Pa, dew point and heat index in Fahrenheit and, as
+ * sums, Kelvin). Doubles are printed with 17 significant digits,
+ * so they read back to the same bits; JSON has no NaN or infinity and gets
+ * null instead. Aggregates of several runs add up field by field (sums and
+ * counts) and by the extremes, as in merge_info.
+ */
+int write_aggregates(const struct state_table *table, FILE *out) {
+    static const char *const names[] = {
+        "state", "records", "avg_temperature_f", "avg_humidity", "avg_cloudcover",
+        "max_temperature_f", "max_temperature_time", "min_temperature_f", "min_temperature_time",
+        "lightning_strikes", "snow_records", "sum_temperature", "temperature_error",
+        "sum_humidity", "sum_cloudcover", "max_temperature", "min_temperature",
+        "avg_pressure", "sum_pressure", "avg_dew_point_f", "dew_point_records", "sum_dew_point",
+        "avg_heat_index_f", "sum_heat_index"
+    };
+    enum { NUM_NAMES = sizeof(names) / sizeof(names[0]) };
+    // The metric a field belongs to; fields of metrics not selected are left out
+    static const unsigned metric_of[NUM_NAMES] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        METRIC_PRESSURE, METRIC_PRESSURE, METRIC_DEW_POINT, METRIC_DEW_POINT, METRIC_DEW_POINT,
+        METRIC_HEAT_INDEX, METRIC_HEAT_INDEX
+    };
+
+    if (options.format == FORMAT_BIN) {
+        struct aggregate_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, AGGREGATE_MAGIC, sizeof(header.magic));
+        header.version = AGGREGATE_VERSION;
+        header.byte_order = CACHE_BYTE_ORDER;
+        header.record_size = sizeof(struct state_record);
+        header.num_states = (uint32_t)table->num_states;
+        header.metrics = options.metrics;
+        if (fwrite(&header, sizeof(header), 1, out) != 1 || write_states(out, table) != 0) {
+            return -1;
+        }
+        return 0;
+    }
+
+    int json = options.format == FORMAT_JSON;
+    struct out_buffer buffer = { NULL, 0, 0, 0, NULL };
+    if (json) {
+        out_str(&buffer, "{\"states\": [");
+    } else {
+        for (int f = 0; f < NUM_NAMES; f++) {
+            if (metric_of[f] == 0 || (options.metrics & metric_of[f])) {
+                out_str(&buffer, f ? "," : "");
+                out_str(&buffer, names[f]);
+            }
+        }
+        out_bytes(&buffer, "\n", 1);
+    }
+    for (int i = 0; i < table->num_states; i++) {
+        const struct climate_info *info = table->states[i];
+        double n = (double)info->num_records;
+        double values[NUM_NAMES] = {
+            0, 0,
+            (double)((temperature_total(info) / n - 273.15) * 9 / 5 + 32),
+            (double)(humidity_total(info) / n),
+            (double)(cloudcover_total(info) / n),
+            (info->max_temp - 273.15) * 9 / 5 + 32, 0,
+            (info->min_temp - 273.15) * 9 / 5 + 32, 0,
+            0, 0,
+            info->sum_temperature, info->temperature_error,
+            (double)humidity_total(info), (double)cloudcover_total(info),
+            info->max_temp, info->min_temp,
+            info->sum_pressure / n, info->sum_pressure,
+            (info->sum_dew_point / (double)info->dew_point_records - 273.15) * 9 / 5 + 32, 0,
+            info->sum_dew_point,
+            (info->sum_heat_index / n - 273.15) * 9 / 5 + 32, info->sum_heat_index
+        };
+        unsigned long long counts[NUM_NAMES] = { 0 };
+        counts[1] = info->num_records;
+        counts[9] = lightning_count(info);
+        counts[10] = snow_count(info);
+        counts[20] = info->dew_point_records;
+
+        out_str(&buffer, json ? (i ? ", {" : "{") : "");
+        for (int f = 0; f < NUM_NAMES; f++) {
+            if (metric_of[f] != 0 && !(options.metrics & metric_of[f])) {
+                continue;
+            }
+            if (json) {
+                out_str(&buffer, f ? ", \"" : "\"");
+                out_str(&buffer, names[f]);
+                out_str(&buffer, "\": ");
+            } else if (f) {
+                out_bytes(&buffer, ",", 1);
+            }
+            if (f == 0) {
+                out_code(&buffer, info->code, json);
+            } else if (f == 6 || f == 8) {
+                time_t t = f == 6 ? info->max_temp_time : info->min_temp_time;
+                if (t < 0) {
+                    out_bytes(&buffer, "-", 1);
+                    out_ulong(&buffer, 0 - (unsigned long long)t);
+                } else {
+                    out_ulong(&buffer, (unsigned long long)t);
+                }
+            } else if (f == 1 || f == 9 || f == 10 || f == 20) {
+                out_ulong(&buffer, counts[f]);
+            } else if (json && !isfinite(values[f])) {
+                out_str(&buffer, "null");
+            } else {
+                char text[32];
+                int len = snprintf(text, sizeof(text), "%.17g", values[f]);
+                out_bytes(&buffer, text, (size_t)len);
+            }
+        }
+        out_str(&buffer, json ? "}" : "\n");
+        if (buffer.len >= OUT_INITIAL && out_flush(&buffer, out) != 0) {
+            out_free(&buffer);
+            return -1;
+        }
+    }
+    if (json) {
+        out_str(&buffer, "]}\n");
     }
+    int failed = out_flush(&buffer, out) != 0;
+    out_free(&buffer);
+    return failed ? -1 : 0;
 }
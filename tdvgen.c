@@ -0,0 +1,165 @@
+/**
+ * tdvgen.c
+ *
+ * Writes synthetic TDV data to standard output for benchmarking climate
+ * (see make bench). The fields follow the shape of the NOAA samples
+ * (data_tn.tdv, data_wa.tdv): hourly timestamps over 2015, 12-character
+ * geohashes under a fixed per-state prefix, whole-number humidity and cloud
+ * cover with spikes at 0 and 100, rare snow and lightning, pressure in Pa and
+ * a seasonal/daily temperature curve in Kelvin.
+ *
+ * Compile:  make tdvgen
+ *
+ * Options:
+ *      -n LINES            number of lines (default: 1000000)
+ *      -s SEED             random seed (default: 1), same seed = same output
+ *      --states all        draw uniformly from the 50 state codes instead of
+ *                          the TN/WA mix of the samples
+ *
+ * Example Run:      ./tdvgen -n 5000000 > bench.tdv
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define YEAR_START 1420070400000ULL  // 2015-01-01 00:00:00 UTC, in ms
+#define HOUR_MS 3600000ULL
+#define YEAR_HOURS 8760
+
+struct state_mix {
+    const char *code;
+    const char *prefix;  // First geohash characters of the state's area
+    unsigned weight;     // Relative share of the records
+};
+
+// Share of records as in the samples: 17097 TN, 48357 WA
+static const struct state_mix sample_mix[] = {
+    { "TN", "dn", 17097 },
+    { "WA", "c2", 48357 },
+};
+
+static const char *const all_states[50] = {
+    "AL", "AK", "AZ", "AR", "CA", "CO", "CT", "DE", "FL", "GA",
+    "HI", "ID", "IL", "IN", "IA", "KS", "KY", "LA", "ME", "MD",
+    "MA", "MI", "MN", "MS", "MO", "MT", "NE", "NV", "NH", "NJ",
+    "NM", "NY", "NC", "ND", "OH", "OK", "OR", "PA", "RI", "SC",
+    "SD", "TN", "TX", "UT", "VT", "VA", "WA", "WV", "WI", "WY",
+};
+
+static const char geohash_chars[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+
+static uint64_t rng_state;
+
+// xorshift64*: fast, and reproducible across platforms
+static uint64_t next_random(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+// Uniform in [0, 1)
+static double uniform(void) {
+    return (double)(next_random() >> 11) / 9007199254740992.0;
+}
+
+// Standard normal, Box-Muller
+static double normal(void) {
+    double u = 1.0 - uniform();
+    return sqrt(-2.0 * log(u)) * cos(6.283185307179586 * uniform());
+}
+
+// Whole percentage with the spikes at 0 and 100 seen in the samples
+static double percentage(double p_zero, double p_hundred) {
+    double u = uniform();
+    if (u < p_zero) return 0.0;
+    if (u < p_zero + p_hundred) return 100.0;
+    return (double)(1 + next_random() % 99);
+}
+
+// Prints a Kelvin value with up to 5 decimals and trailing zeros dropped
+static void print_temperature(double kelvin) {
+    char buffer[32];
+    int len = snprintf(buffer, sizeof(buffer), "%.5f", kelvin);
+    while (len > 2 && buffer[len - 1] == '0' && buffer[len - 2] != '.') {
+        buffer[--len] = '\0';
+    }
+    fputs(buffer, stdout);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long long lines = 1000000;
+    uint64_t seed = 1;
+    int uniform_states = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        char *end;
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            lines = strtoull(argv[++i], &end, 10);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], &end, 10);
+        } else if (strcmp(argv[i], "--states") == 0 && i + 1 < argc && strcmp(argv[i + 1], "all") == 0) {
+            uniform_states = 1;
+            i++;
+        } else {
+            fprintf(stderr, "Usage: %s [-n lines] [-s seed] [--states all]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;  // Never zero
+
+    unsigned total_weight = 0;
+    for (size_t i = 0; i < sizeof(sample_mix) / sizeof(sample_mix[0]); i++) {
+        total_weight += sample_mix[i].weight;
+    }
+
+    for (unsigned long long n = 0; n < lines; n++) {
+        const char *code;
+        char geohash[13];
+        if (uniform_states) {
+            int s = (int)(next_random() % 50);
+            code = all_states[s];
+            geohash[0] = geohash_chars[s % 32];
+            geohash[1] = geohash_chars[(s * 7) % 32];
+        } else {
+            unsigned pick = (unsigned)(next_random() % total_weight);
+            size_t s = 0;
+            while (pick >= sample_mix[s].weight) {
+                pick -= sample_mix[s].weight;
+                s++;
+            }
+            code = sample_mix[s].code;
+            geohash[0] = sample_mix[s].prefix[0];
+            geohash[1] = sample_mix[s].prefix[1];
+        }
+        for (int i = 2; i < 12; i++) {
+            geohash[i] = geohash_chars[next_random() % 32];
+        }
+        geohash[12] = '\0';
+
+        unsigned hour = (unsigned)(next_random() % YEAR_HOURS);
+        unsigned long long timestamp = YEAR_START + hour * HOUR_MS;
+
+        // Coldest in mid-January, warmest in mid-July, and in the early morning
+        double season = cos(6.283185307179586 * ((double)hour / YEAR_HOURS - 0.04));
+        double day = cos(6.283185307179586 * ((double)(hour % 24) - 15.0) / 24.0);
+        double kelvin = 284.0 - 11.0 * season + 5.0 * day + 5.0 * normal();
+
+        double humidity = percentage(0.0, 0.07);
+        double cloudcover = percentage(0.31, 0.43);
+        double pressure = floor(100500.0 + 2000.0 * normal());
+        int snow = uniform() < (kelvin < 275.0 ? 0.12 : 0.002);
+        int lightning = uniform() < 0.024;
+
+        printf("%s\t%llu\t%s\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t", code, timestamp, geohash,
+               humidity, (double)snow, cloudcover, (double)lightning, pressure);
+        print_temperature(kelvin);
+        putchar('\n');
+    }
+    return ferror(stdout) ? EXIT_FAILURE : EXIT_SUCCESS;
+}